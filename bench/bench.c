@@ -0,0 +1,305 @@
+#include "ast.h"
+#include "lexer.h"
+#include "utils.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// Lexer and parser throughput on a synthetic corpus, reported as JSON.
+//
+// The corpus is one long Lox expression, a line of it at a time, with
+// comment lines mixed in. The grammar has no identifier expressions yet, so
+// the parser is timed on a twin corpus where identifier operands are `nil`.
+
+typedef struct {
+  size_t size; // bytes, the corpus stops at the first line past it
+  double ident_density; // share of operands that are identifiers
+  double comment_ratio; // share of lines that are comments
+  int depth;            // nesting depth of each line's expression
+  int iterations;       // the best run is reported
+  uint64_t seed;
+} BenchOptions;
+
+typedef struct {
+  Output text;
+  uint64_t state;
+  const BenchOptions *options;
+  bool identifiers;
+  size_t lines;
+} Corpus;
+
+static uint64_t next_random(Corpus *corpus) {
+  // xorshift64*
+  corpus->state ^= corpus->state >> 12;
+  corpus->state ^= corpus->state << 25;
+  corpus->state ^= corpus->state >> 27;
+  return corpus->state * 0x2545F4914F6CDD1DULL;
+}
+
+static double random_unit(Corpus *corpus) {
+  return (double)(next_random(corpus) >> 11) / (double)(1ULL << 53);
+}
+
+static void emit(Corpus *corpus, const char *text) {
+  output_string(&corpus->text, text);
+}
+
+static void emit_operand(Corpus *corpus) {
+  char buf[32];
+  // Drawn either way so both twins share their structure.
+  bool identifier = random_unit(corpus) < corpus->options->ident_density;
+  uint64_t pick = next_random(corpus);
+  if (identifier) {
+    if (corpus->identifiers) {
+      snprintf(buf, sizeof(buf), "name_%u", (unsigned)(pick % 4096));
+      emit(corpus, buf);
+    } else {
+      emit(corpus, "nil");
+    }
+    return;
+  }
+
+  switch (pick % 10) {
+  case 0:
+    emit(corpus, "\"some string\"");
+    break;
+  case 1:
+    emit(corpus, pick & 0x100 ? "true" : "false");
+    break;
+  case 2:
+  case 3:
+    snprintf(buf, sizeof(buf), "%u.%u", (unsigned)(pick >> 8) % 100000,
+             (unsigned)(pick >> 32) % 1000);
+    emit(corpus, buf);
+    break;
+  default:
+    snprintf(buf, sizeof(buf), "%u", (unsigned)(pick >> 8) % 100000);
+    emit(corpus, buf);
+    break;
+  }
+}
+
+static const char *BINARY_OPERATORS[] = {"+",  "-",  "*", "/",  "==",
+                                         "!=", ">",  ">=", "<", "<="};
+
+static void emit_expression(Corpus *corpus, int depth) {
+  if (depth == 0) {
+    emit_operand(corpus);
+    return;
+  }
+
+  uint64_t pick = next_random(corpus);
+  switch (pick % 4) {
+  case 0:
+    emit(corpus, "(");
+    emit_expression(corpus, depth - 1);
+    emit(corpus, ")");
+    break;
+  case 1:
+    emit(corpus, pick & 0x100 ? "-" : "!");
+    emit_expression(corpus, depth - 1);
+    break;
+  default:
+    emit_expression(corpus, depth - 1);
+    emit(corpus, " ");
+    emit(corpus, BINARY_OPERATORS[(pick >> 16) % 10]);
+    emit(corpus, " ");
+    emit_expression(corpus, depth - 1);
+    break;
+  }
+}
+
+// NUL terminated, as the lexer expects; `length` excludes the terminator.
+// Stops after `*lines` lines if that is non-zero, and otherwise at the first
+// line past the requested size.
+static char *generate_corpus(const BenchOptions *options, bool identifiers,
+                             size_t *length, size_t *lines) {
+  Corpus corpus = {.state = options->seed ? options->seed : 1,
+                   .options = options,
+                   .identifiers = identifiers};
+  size_t limit = *lines;
+  bool first = true;
+  while (limit ? corpus.lines < limit : corpus.text.length < options->size) {
+    corpus.lines++;
+    if (random_unit(&corpus) < options->comment_ratio) {
+      emit(&corpus, "// a comment line between two parts of the expression\n");
+      continue;
+    }
+    emit(&corpus, first ? "  " : "+ ");
+    first = false;
+    emit_expression(&corpus, options->depth);
+    emit(&corpus, "\n");
+  }
+  if (first)
+    emit(&corpus, "0\n");
+
+  *length = corpus.text.length;
+  *lines = corpus.lines;
+  output_write(&corpus.text, "", 1);
+  return corpus.text.data;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// A heap copy for the lexer, which frees its source.
+static Lexer corpus_lexer(const char *corpus, size_t length) {
+  char *source = malloc(length + 1);
+  if (source == NULL) {
+    fprintf(stderr, ERROR ": memory allocation for corpus failed\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(source, corpus, length + 1);
+  return init_lexer("bench", source, length);
+}
+
+static bool parse_size(const char *text, size_t *size) {
+  char *end;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (end == text)
+    return false;
+  if (*end == 'K' || *end == 'k')
+    value <<= 10, end++;
+  else if (*end == 'M' || *end == 'm')
+    value <<= 20, end++;
+  else if (*end == 'G' || *end == 'g')
+    value <<= 30, end++;
+  *size = (size_t)value;
+  return *end == '\0';
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "Usage: bench [--size=BYTES[K|M|G]] [--ident-density=0..1]\n"
+          "             [--comment-ratio=0..1] [--depth=0..16]\n"
+          "             [--iterations=N] [--seed=N]\n");
+}
+
+int main(int argc, char *argv[]) {
+  BenchOptions options = {.size = 16 << 20,
+                          .ident_density = 0.3,
+                          .comment_ratio = 0.1,
+                          .depth = 4,
+                          .iterations = 5,
+                          .seed = 42};
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *value = strchr(arg, '=');
+    value = value ? value + 1 : "";
+    bool ok = true;
+    if (strncmp(arg, "--size=", 7) == 0)
+      ok = parse_size(value, &options.size);
+    else if (strncmp(arg, "--ident-density=", 16) == 0)
+      options.ident_density = atof(value);
+    else if (strncmp(arg, "--comment-ratio=", 16) == 0)
+      options.comment_ratio = atof(value);
+    else if (strncmp(arg, "--depth=", 8) == 0)
+      options.depth = atoi(value);
+    else if (strncmp(arg, "--iterations=", 13) == 0)
+      options.iterations = atoi(value);
+    else if (strncmp(arg, "--seed=", 7) == 0)
+      options.seed = strtoull(value, NULL, 10);
+    else
+      ok = false;
+
+    if (!ok) {
+      fprintf(stderr, ERROR ": Unexpected argument: %s\n", arg);
+      usage();
+      return 64;
+    }
+  }
+  if (options.depth < 0 || options.depth > 16 || options.iterations < 1 ||
+      options.ident_density < 0 || options.ident_density > 1 ||
+      options.comment_ratio < 0 || options.comment_ratio >= 1) {
+    usage();
+    return 64;
+  }
+
+  size_t length, lines = 0, parse_length;
+  char *corpus = generate_corpus(&options, true, &length, &lines);
+  char *parse_corpus =
+      generate_corpus(&options, false, &parse_length, &lines);
+
+  double scan_best = 0;
+  size_t tokens = 0;
+  for (int i = 0; i < options.iterations; i++) {
+    Lexer lexer = corpus_lexer(corpus, length);
+    double start = now();
+    scan_tokens(&lexer);
+    double elapsed = now() - start;
+    if (i == 0 || elapsed < scan_best)
+      scan_best = elapsed;
+    tokens = arrlenu(lexer.tokens);
+    free_lexer(&lexer);
+  }
+
+  double stream_best = 0, parse_best = 0, print_best = 0;
+  size_t parse_tokens_count = 0, nodes = 0, printed = 0;
+  for (int i = 0; i < options.iterations; i++) {
+    Lexer lexer = corpus_lexer(parse_corpus, parse_length);
+    double start = now();
+    TokenStream stream = scan_token_stream(&lexer);
+    double middle = now();
+    Parser parser = parse_tokens("bench", stream, NULL);
+    double end = now();
+    if (parser.had_error) {
+      fprintf(stderr, ERROR ": benchmark corpus failed to parse\n");
+      return EXIT_FAILURE;
+    }
+    // Printed to memory, a whole-tree pass without the cost of I/O.
+    Output text = {0};
+    double print_start = now();
+    print_ast(&parser, &text);
+    double print_end = now();
+    if (i == 0 || middle - start < stream_best)
+      stream_best = middle - start;
+    if (i == 0 || end - middle < parse_best)
+      parse_best = end - middle;
+    if (i == 0 || print_end - print_start < print_best)
+      print_best = print_end - print_start;
+    parse_tokens_count = stream_length(&parser.tokens);
+    nodes = arrlenu(parser.nodes);
+    printed = text.length;
+    free_output(&text);
+    free_parser(&parser);
+    free_lexer(&lexer);
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  printf("{\n");
+  printf("  \"corpus\": {\"bytes\": %zu, \"parse_bytes\": %zu, "
+         "\"lines\": %zu, \"seed\": %llu, \"ident_density\": %g, "
+         "\"comment_ratio\": %g, \"depth\": %d},\n",
+         length, parse_length, lines, (unsigned long long)options.seed,
+         options.ident_density, options.comment_ratio, options.depth);
+  printf("  \"iterations\": %d,\n", options.iterations);
+  printf("  \"scan_tokens\": {\"seconds\": %.6f, \"mb_per_s\": %.2f, "
+         "\"tokens\": %zu, \"tokens_per_s\": %.0f},\n",
+         scan_best, length / 1e6 / scan_best, tokens, tokens / scan_best);
+  printf("  \"token_stream\": {\"seconds\": %.6f, \"mb_per_s\": %.2f, "
+         "\"tokens\": %zu, \"tokens_per_s\": %.0f},\n",
+         stream_best, parse_length / 1e6 / stream_best, parse_tokens_count,
+         parse_tokens_count / stream_best);
+  printf("  \"parse\": {\"seconds\": %.6f, \"mb_per_s\": %.2f, "
+         "\"nodes\": %zu, \"nodes_per_s\": %.0f, \"tokens_per_s\": %.0f},\n",
+         parse_best, parse_length / 1e6 / parse_best, nodes,
+         nodes / parse_best, parse_tokens_count / parse_best);
+  printf("  \"print\": {\"seconds\": %.6f, \"mb_per_s\": %.2f, "
+         "\"bytes\": %zu, \"nodes_per_s\": %.0f},\n",
+         print_best, printed / 1e6 / print_best, printed, nodes / print_best);
+  printf("  \"peak_rss_kb\": %ld\n", usage.ru_maxrss);
+  printf("}\n");
+
+  free(corpus);
+  free(parse_corpus);
+  return EXIT_SUCCESS;
+}
@@ -5,15 +5,35 @@
 
 #define BUILD_FOLDER "build/"
 #define SRC_FOLDER "src/"
+#define BENCH_FOLDER "bench/"
+#define TEST_FOLDER "test/"
+#define EXAMPLES_FOLDER "examples/"
 
-int main(int argc, char **argv) {
-  NOB_GO_REBUILD_URSELF(argc, argv);
+static bool build_clox(Nob_Cmd *cmd) {
+  nob_cmd_append(cmd, "gcc", "-Wall", "-Wextra", "-fPIE", "-g", "-pthread");
+  nob_cmd_append(cmd, "-I" SRC_FOLDER);
+  nob_cmd_append(cmd, "-o", "clox");
+  nob_cmd_append(cmd, SRC_FOLDER "main.c");
+  nob_cmd_append(cmd, SRC_FOLDER "ast.c");
+  nob_cmd_append(cmd, SRC_FOLDER "cache.c");
+  nob_cmd_append(cmd, SRC_FOLDER "dump.c");
+  nob_cmd_append(cmd, SRC_FOLDER "lexer.c");
+  nob_cmd_append(cmd, SRC_FOLDER "stb_ds.c");
+  nob_cmd_append(cmd, SRC_FOLDER "utils.c");
+  return nob_cmd_run_sync_and_reset(cmd);
+}
+
+// `./nob bench [ARGS...]` builds the benchmark without debug output and
+// runs it, see bench/bench.c for its arguments.
+static int bench(int argc, char **argv) {
+  if (!nob_mkdir_if_not_exists(BUILD_FOLDER))
+    return 1;
 
   Nob_Cmd cmd = {0};
-  nob_cmd_append(&cmd, "gcc", "-Wall", "-Wextra", "-fPIE", "-g");
-  nob_cmd_append(&cmd, "-I" SRC_FOLDER);
-  nob_cmd_append(&cmd, "-o", "clox");
-  nob_cmd_append(&cmd, SRC_FOLDER "main.c");
+  nob_cmd_append(&cmd, "gcc", "-Wall", "-Wextra", "-O2", "-g", "-pthread");
+  nob_cmd_append(&cmd, "-DDEBUG=0", "-I" SRC_FOLDER);
+  nob_cmd_append(&cmd, "-o", BUILD_FOLDER "bench");
+  nob_cmd_append(&cmd, BENCH_FOLDER "bench.c");
   nob_cmd_append(&cmd, SRC_FOLDER "ast.c");
   nob_cmd_append(&cmd, SRC_FOLDER "lexer.c");
   nob_cmd_append(&cmd, SRC_FOLDER "stb_ds.c");
@@ -21,5 +41,92 @@ int main(int argc, char **argv) {
   if (!nob_cmd_run_sync_and_reset(&cmd))
     return 1;
 
+  nob_cmd_append(&cmd, BUILD_FOLDER "bench");
+  while (argc > 0)
+    nob_cmd_append(&cmd, nob_shift(argv, argc));
+  if (!nob_cmd_run_sync_and_reset(&cmd))
+    return 1;
+
+  return 0;
+}
+
+// Writes a token dump of `source` with clox and checks it against `other`.
+static bool test_dump(Nob_Cmd *cmd, const char *source, const char *other) {
+  Nob_Fd dump = nob_fd_open_for_write(BUILD_FOLDER "test.tokens");
+  Nob_Fd log = nob_fd_open_for_write(BUILD_FOLDER "test.log");
+  if (dump == NOB_INVALID_FD || log == NOB_INVALID_FD)
+    return false;
+  nob_cmd_append(cmd, "./clox", "tokenize", "--format=bin", source);
+  bool ok = nob_cmd_run_sync_redirect_and_reset(
+      cmd, (Nob_Cmd_Redirect){.fdout = &dump, .fderr = &log});
+  nob_fd_close(dump);
+  nob_fd_close(log);
+  if (!ok)
+    return false;
+
+  nob_cmd_append(cmd, BUILD_FOLDER "dump_test", BUILD_FOLDER "test.tokens",
+                 source, other);
+  return nob_cmd_run_sync_and_reset(cmd);
+}
+
+// `./nob test` builds clox and the tests in test/ and runs them.
+static int test(void) {
+  if (!nob_mkdir_if_not_exists(BUILD_FOLDER))
+    return 1;
+
+  Nob_Cmd cmd = {0};
+  if (!build_clox(&cmd))
+    return 1;
+
+  nob_cmd_append(&cmd, "gcc", "-Wall", "-Wextra", "-g", "-pthread");
+  nob_cmd_append(&cmd, "-DDEBUG=0", "-I" SRC_FOLDER);
+  nob_cmd_append(&cmd, "-o", BUILD_FOLDER "dump_test");
+  nob_cmd_append(&cmd, TEST_FOLDER "dump_test.c");
+  nob_cmd_append(&cmd, SRC_FOLDER "dump.c");
+  nob_cmd_append(&cmd, SRC_FOLDER "lexer.c");
+  nob_cmd_append(&cmd, SRC_FOLDER "stb_ds.c");
+  nob_cmd_append(&cmd, SRC_FOLDER "utils.c");
+  if (!nob_cmd_run_sync_and_reset(&cmd))
+    return 1;
+
+  // A small gap makes edits outgrow it, and the text move, all the time.
+  nob_cmd_append(&cmd, "gcc", "-Wall", "-Wextra", "-g", "-pthread");
+  nob_cmd_append(&cmd, "-DDEBUG=0", "-DLEXER_EDIT_GAP=16", "-I" SRC_FOLDER);
+  nob_cmd_append(&cmd, "-o", BUILD_FOLDER "relex_test");
+  nob_cmd_append(&cmd, TEST_FOLDER "relex_test.c");
+  nob_cmd_append(&cmd, SRC_FOLDER "lexer.c");
+  nob_cmd_append(&cmd, SRC_FOLDER "stb_ds.c");
+  nob_cmd_append(&cmd, SRC_FOLDER "utils.c");
+  if (!nob_cmd_run_sync_and_reset(&cmd))
+    return 1;
+
+  nob_cmd_append(&cmd, BUILD_FOLDER "relex_test");
+  if (!nob_cmd_run_sync_and_reset(&cmd))
+    return 1;
+
+  if (!test_dump(&cmd, EXAMPLES_FOLDER "example.lox",
+                 EXAMPLES_FOLDER "basic.lox") ||
+      !test_dump(&cmd, EXAMPLES_FOLDER "basic.lox",
+                 EXAMPLES_FOLDER "example.lox"))
+    return 1;
+
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  NOB_GO_REBUILD_URSELF(argc, argv);
+
+  nob_shift(argv, argc); // program name
+  if (argc > 0 && strcmp(argv[0], "bench") == 0) {
+    nob_shift(argv, argc);
+    return bench(argc, argv);
+  }
+  if (argc > 0 && strcmp(argv[0], "test") == 0)
+    return test();
+
+  Nob_Cmd cmd = {0};
+  if (!build_clox(&cmd))
+    return 1;
+
   return 0;
 }
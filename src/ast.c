@@ -1,117 +1,193 @@
 #include "ast.h"
 #include "lexer.h"
 #include "utils.h"
-#include <stdarg.h>
+#include <setjmp.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-Expr *expression(Parser *parser);
-Expr *equality(Parser *parser);
-Expr *comparison(Parser *parser);
-Expr *term(Parser *parser);
-Expr *factor(Parser *parser);
-Expr *unary(Parser *parser);
-Expr *primary(Parser *parser);
-
-#define arrput_getp(arr, value)                                                \
-  ((arrput((arr), (value))), &((arr)[arrlen(arr) - 1]))
-
-void ast_error(const char *fmt, ...) {
-  va_list args;
-  va_start(args, fmt);
-  fprintf(stderr, ERROR ": ");
-  vfprintf(stderr, fmt, args);
-  fprintf(stderr, "\n");
-  va_end(args);
-}
+ExprId expression(Parser *parser);
+ExprId unary(Parser *parser);
+ExprId primary(Parser *parser);
+
+_Static_assert(sizeof(Expr) <= 16, "Expr holds indices, not tokens");
 
-// AstPrinter
-void *print_literal(ExprVisitor *_, Token *literal) {
-  (void)_; // unused
+// The room was reserved by `parse_tokens`, so this never reallocates.
+static ExprId new_expr(Parser *parser, Expr expr) {
+  ExprId id = (ExprId)arrlenu(parser->nodes);
+  arrput(parser->nodes, expr);
+  return id;
+}
 
+// Printer
+static void output_literal(Output *out, const Token *literal) {
   switch (literal->type) {
   case TOKEN_NUMBER:
-    printf("%f", literal->value.as.number_value);
+    output_number(out, literal->value.as.number_value);
     break;
   case TOKEN_STRING:
-    printf("\"");
-    PRINT_AS_STRING(string, literal);
-    printf("\"");
+    output_string(out, "\"");
+    output_write(out, literal->value.as.string_value.start,
+                 literal->value.as.string_value.length);
+    output_string(out, "\"");
     break;
   case TOKEN_IDENTIFIER:
-    printf("[");
-    PRINT_AS_STRING(identifier, literal);
-    printf("]");
+    output_string(out, "[");
+    output_write(out, literal->value.as.identifier_value.start,
+                 literal->value.as.identifier_value.length);
+    output_string(out, "]");
     break;
   case TOKEN_TRUE:
-    printf("%s", literal->value.as.bool_value ? "true"
-                                              : "<err: false found when true>");
+    output_string(out, literal->value.as.bool_value
+                           ? "true"
+                           : "<err: false found when true>");
     break;
   case TOKEN_FALSE:
-    printf("%s", literal->value.as.bool_value ? "false"
-                                              : "<err: true found when false>");
+    output_string(out, literal->value.as.bool_value
+                           ? "false"
+                           : "<err: true found when false>");
     break;
   default:
-    printf("%s", TOKEN_REPRESENTATIONS[literal->type].name);
+    output_string(out, TOKEN_REPRESENTATIONS[literal->type].name);
     break;
   }
-  return NULL;
-};
-
-void *print_unary(ExprVisitor *visitor, UnaryExpr *expr) {
-  printf("( ");
-  printf("%s ", TOKEN_REPRESENTATIONS[expr->op.type].symbol);
-  expr_accept(expr->right, visitor);
-  printf(" )");
-  return NULL;
-};
-
-void *print_binary(ExprVisitor *visitor, BinaryExpr *expr) {
-  printf("( ");
-  printf("%s", TOKEN_REPRESENTATIONS[expr->op.type].symbol);
-  printf(" ");
-  expr_accept(expr->left, visitor);
-  printf(" ");
-  expr_accept(expr->right, visitor);
-  printf(" )");
-  return NULL;
 }
-void *print_grouping(ExprVisitor *visitor, GroupingExpr *expr) {
-  printf("( group ");
-  expr_accept(expr->expression, visitor);
-  printf(" )");
-  return NULL;
+
+// Every other node prints as its head, its children separated by spaces,
+// then " )". Operators' heads are "( " symbol " ".
+typedef struct {
+  char text[8];
+  size_t length;
+} PrintHead;
+
+#define PRINT_CLOSE " )"
+static const PrintHead GROUP_HEAD = {.text = "( group ", .length = 8};
+
+static PrintHead operator_head(TokenType type) {
+  PrintHead head = {.text = "( "};
+  const char *symbol = TOKEN_REPRESENTATIONS[type].symbol;
+  if (symbol == NULL || strlen(symbol) + 3 > sizeof(head.text))
+    return head; // not an operator
+  size_t length = strlen(symbol);
+  memcpy(head.text + 2, symbol, length);
+  head.text[length + 2] = ' ';
+  head.length = length + 3;
+  return head;
 }
 
-const ExprVisitor AstPrinter = {.visit_literal = print_literal,
-                                .visit_unary = print_unary,
-                                .visit_binary = print_binary,
-                                .visit_grouping = print_grouping};
-
-void *expr_accept(Expr *expr, ExprVisitor *visitor) {
-  switch (expr->type) {
-  case EXPR_LITERAL:
-    return visitor->visit_literal(visitor, &expr->value.literal);
-  case EXPR_UNARY:
-    return visitor->visit_unary(visitor, &expr->value.unary);
-  case EXPR_BINARY:
-    return visitor->visit_binary(visitor, &expr->value.binary);
-  case EXPR_GROUPING:
-    return visitor->visit_grouping(visitor, &expr->value.grouping);
+// Two linear scans over the post-order nodes instead of a descent through
+// the tree. The forward scan works out the length of each subtree's text
+// from its children's, and formats the literals; those come out in the same
+// order as they appear in the text. The backward scan meets every node
+// before its children, writes the node's own text where its parent placed
+// it, and places the children's text around it.
+void print_ast(const Parser *parser, Output *out) {
+  const TokenStream *tokens = &parser->tokens;
+  const Expr *nodes = parser->nodes;
+  size_t count = arrlenu(nodes);
+  ASSERT(count > 0 && parser->root == count - 1,
+         "Printing a tree that isn't a complete parse");
+  PrintHead heads[TOKEN_TYPE_LEN];
+  for (int type = 0; type < TOKEN_TYPE_LEN; type++)
+    heads[type] = operator_head(type);
+  size_t close = strlen(PRINT_CLOSE);
+
+  size_t *lengths = NULL; // Vec<size_t>, of each subtree's text
+  arrsetlen(lengths, count);
+  Output literals = {0};
+  for (size_t i = 0; i < count; i++) {
+    const Expr *expr = &nodes[i];
+    switch (expr->type) {
+    case EXPR_LITERAL: {
+      size_t before = literals.length;
+      Token literal = stream_token(tokens, expr->value.literal);
+      output_literal(&literals, &literal);
+      lengths[i] = literals.length - before;
+      break;
+    }
+    case EXPR_UNARY: {
+      const UnaryExpr *unary = &expr->value.unary;
+      lengths[i] = heads[stream_token_type(tokens, unary->op)].length +
+                   lengths[unary->right] + close;
+      break;
+    }
+    case EXPR_BINARY: {
+      const BinaryExpr *binary = &expr->value.binary;
+      lengths[i] = heads[stream_token_type(tokens, binary->op)].length +
+                   lengths[binary->left] + 1 + lengths[binary->right] + close;
+      break;
+    }
+    case EXPR_GROUPING:
+      lengths[i] =
+          GROUP_HEAD.length + lengths[expr->value.grouping.expression] + close;
+      break;
+    }
   }
-  return NULL;
+
+  size_t total = lengths[count - 1];
+  char *text = malloc(total);
+  if (text == NULL) {
+    fprintf(stderr, ERROR ": memory allocation for %zu bytes of output failed\n",
+            total);
+    exit(EXIT_FAILURE);
+  }
+  size_t *starts = NULL; // Vec<size_t>, of each subtree's text
+  arrsetlen(starts, count);
+  starts[count - 1] = 0;
+  size_t literals_end = literals.length;
+  for (size_t i = count; i-- > 0;) {
+    const Expr *expr = &nodes[i];
+    char *at = text + starts[i];
+    const PrintHead *head = &GROUP_HEAD;
+    ExprId last = EXPR_NONE; // the child whose text the node's closes
+    switch (expr->type) {
+    case EXPR_LITERAL:
+      literals_end -= lengths[i];
+      memcpy(at, literals.data + literals_end, lengths[i]);
+      continue;
+    case EXPR_UNARY:
+      head = &heads[stream_token_type(tokens, expr->value.unary.op)];
+      last = expr->value.unary.right;
+      break;
+    case EXPR_BINARY:
+      head = &heads[stream_token_type(tokens, expr->value.binary.op)];
+      last = expr->value.binary.right;
+      break;
+    case EXPR_GROUPING:
+      last = expr->value.grouping.expression;
+      break;
+    }
+    memcpy(at, head->text, head->length);
+    at += head->length;
+    if (expr->type == EXPR_BINARY) {
+      ExprId left = expr->value.binary.left;
+      starts[left] = at - text;
+      at += lengths[left];
+      *at++ = ' ';
+    }
+    starts[last] = at - text;
+    memcpy(at + lengths[last], PRINT_CLOSE, close);
+  }
+
+  output_write(out, text, total);
+  free(text);
+  arrfree(starts);
+  arrfree(lengths);
+  free(literals.data);
 }
 
 // Parser
 static Token previous(Parser *parser) {
-  return parser->tokens[parser->index - 1];
+  return stream_token(&parser->tokens, parser->index - 1);
 }
-static Token peek(Parser *parser) { return parser->tokens[parser->index]; }
-static bool finished(Parser *parser) { return peek(parser).type == TOKEN_EOF; }
-static bool check(Parser *parser, TokenType expected) {
-  if (finished(parser))
-    return false;
-  return (parser->current->type == expected);
+static Token peek(Parser *parser) {
+  return stream_token(&parser->tokens, parser->index);
 }
+static TokenType peek_type(Parser *parser) {
+  return stream_token_type(&parser->tokens, parser->index);
+}
+static bool finished(Parser *parser) { return peek_type(parser) == TOKEN_EOF; }
 
 static Token advance(Parser *parser) {
   debug("Advanced parser");
@@ -125,173 +201,175 @@ static Token advance(Parser *parser) {
     token = peek(parser);
   } else {
     parser->index++;
-    parser->current = &parser->tokens[parser->index];
     token = previous(parser);
   }
 
   return token;
 };
 
-static bool match(Parser *parser, uint32_t count, ...) {
-  debug("Matching [%d] values", count);
-  va_list args;
-  va_start(args, count);
-  for (uint32_t i = 0; i < count; i++) {
-    TokenType expected = va_arg(args, TokenType);
-    debug("-- Trying to match: %s", TOKEN_REPRESENTATIONS[expected].name);
-    if (check(parser, expected)) {
-      debug("Match SUCCESS");
-      advance(parser);
-      va_end(args);
-      return true;
-    }
-  }
-
-  va_end(args);
-  return false;
-}
-
-Expr *expression(Parser *parser) {
-  debug("Parsing [EXPRESSION]");
-  return equality(parser);
-}
-
-Expr *equality(Parser *parser) {
-  Expr *expr = comparison(parser);
-  debug("Parsing [EQUALITY]");
-  while (match(parser, 2, TOKEN_BANG_EQUAL, TOKEN_EQUAL_EQUAL)) {
-    Token operator = previous(parser);
-    debug("Operator");
-    debug_token(&operator);
-    Expr *right = comparison(parser);
-    expr = arrput_getp(
-        parser->expressions,
-        ((Expr){
-            .type = EXPR_BINARY,
-            .value = {.binary = {.left = expr, .op = operator, .right = right}}
-
-        }));
-  }
-  return expr;
+// Sets of token types, one bit per type, so matching against any number of
+// candidates is a single AND.
+typedef uint64_t TokenSet;
+#define TOKEN_SET(TYPE) ((TokenSet)1 << (TYPE))
+_Static_assert(TOKEN_TYPE_LEN <= 64, "TokenSet has a bit per TokenType");
+
+static const TokenSet UNARY_OPERATORS =
+    TOKEN_SET(TOKEN_BANG) | TOKEN_SET(TOKEN_MINUS);
+static const TokenSet LITERALS = TOKEN_SET(TOKEN_FALSE) |
+                                 TOKEN_SET(TOKEN_TRUE) | TOKEN_SET(TOKEN_NIL) |
+                                 TOKEN_SET(TOKEN_STRING) |
+                                 TOKEN_SET(TOKEN_NUMBER);
+
+// Consume the next token if its type is in `expected`. EOF is never in a set.
+static bool match(Parser *parser, TokenSet expected) {
+  if ((TOKEN_SET(peek_type(parser)) & expected) == 0)
+    return false;
+  debug("Match SUCCESS");
+  advance(parser);
+  return true;
 }
 
-Expr *comparison(Parser *parser) {
-  debug("Parsing [COMPARISON]");
-  Expr *expr = term(parser);
-  while (match(parser, 2, TOKEN_GREATER, TOKEN_GREATER_EQUAL, TOKEN_LESS,
-               TOKEN_LESS_EQUAL)) {
-    Token operator = previous(parser);
-    debug("Operator");
-    debug_token(&operator);
-    Expr *right = term(parser);
-    expr = arrput_getp(
-        parser->expressions,
-        ((Expr){
-            .type = EXPR_BINARY,
-            .value = {.binary = {.left = expr, .op = operator, .right = right}}
-
-        }));
-  }
-  return expr;
-}
+// Binary operators, by how tightly they bind. All are left-associative.
+typedef enum {
+  PREC_NONE, // not a binary operator
+  PREC_EQUALITY,
+  PREC_COMPARISON,
+  PREC_TERM,
+  PREC_FACTOR,
+} Precedence;
+
+static const uint8_t BINARY_PRECEDENCE[TOKEN_TYPE_LEN] = {
+    [TOKEN_BANG_EQUAL] = PREC_EQUALITY,
+    [TOKEN_EQUAL_EQUAL] = PREC_EQUALITY,
+    [TOKEN_GREATER] = PREC_COMPARISON,
+    [TOKEN_GREATER_EQUAL] = PREC_COMPARISON,
+    [TOKEN_LESS] = PREC_COMPARISON,
+    [TOKEN_LESS_EQUAL] = PREC_COMPARISON,
+    [TOKEN_MINUS] = PREC_TERM,
+    [TOKEN_PLUS] = PREC_TERM,
+    [TOKEN_SLASH] = PREC_FACTOR,
+    [TOKEN_STAR] = PREC_FACTOR,
+};
 
-Expr *term(Parser *parser) {
-  Expr *expr = factor(parser);
-  debug("Parsing [TERM]");
-  while (match(parser, 2, TOKEN_MINUS, TOKEN_PLUS)) {
-    Token operator = previous(parser);
+// Precedence climbing: an operand, then every operator binding at least as
+// tightly as `lowest`, each with a right operand of the operators binding
+// tighter still. One table lookup per token replaces a rule per level.
+static ExprId binary(Parser *parser, Precedence lowest) {
+  ExprId expr = unary(parser);
+  for (;;) {
+    Precedence precedence = BINARY_PRECEDENCE[peek_type(parser)];
+    if (precedence < lowest)
+      return expr;
+
+    TokenId operator = (TokenId)parser->index;
+    advance(parser);
     debug("Operator");
-    debug_token(&operator);
-    Expr *right = factor(parser);
-    expr = arrput_getp(
-        parser->expressions,
-        ((Expr){
+    debug_block({
+      Token token = previous(parser);
+      debug_token(&token);
+    });
+    ExprId right = binary(parser, precedence + 1);
+    expr = new_expr(
+        parser,
+        (Expr){
             .type = EXPR_BINARY,
             .value = {.binary = {.left = expr, .op = operator, .right = right}}
 
-        }));
+        });
   }
-  return expr;
 }
 
-Expr *factor(Parser *parser) {
-  Expr *expr = unary(parser);
-  debug("Parsing [FACTOR]");
-  while (match(parser, 2, TOKEN_SLASH, TOKEN_STAR)) {
-    Token operator = previous(parser);
-    debug("Operator");
-    debug_token(&operator);
-    Expr *right = unary(parser);
-    expr = arrput_getp(
-        parser->expressions,
-        ((Expr){
-            .type = EXPR_BINARY,
-            .value = {.binary = {.left = expr, .op = operator, .right = right}}
-
-        }));
-  }
-  return expr;
+ExprId expression(Parser *parser) {
+  debug("Parsing [EXPRESSION]");
+  return binary(parser, PREC_EQUALITY);
 }
 
-Expr *unary(Parser *parser) {
+ExprId unary(Parser *parser) {
   debug("Parsing [UNARY]");
-  if (match(parser, 2, TOKEN_BANG, TOKEN_MINUS)) {
-    Token operator = previous(parser);
+  if (match(parser, UNARY_OPERATORS)) {
+    TokenId operator = (TokenId)(parser->index - 1);
     debug("Operator");
-    debug_token(&operator);
-    Expr *right = unary(parser);
-    return arrput_getp(
-        parser->expressions,
-        ((Expr){.type = EXPR_UNARY,
-                .value = {.unary = {.op = operator, .right = right}}}));
+    debug_block({
+      Token token = previous(parser);
+      debug_token(&token);
+    });
+    ExprId right = unary(parser);
+    return new_expr(
+        parser, (Expr){.type = EXPR_UNARY,
+                       .value = {.unary = {.op = operator, .right = right}}});
   }
   return primary(parser);
 }
 
-Expr *primary(Parser *parser) {
+ExprId primary(Parser *parser) {
   debug("Parsing [PRIMARY]");
-  if (match(parser, 5, TOKEN_FALSE, TOKEN_TRUE, TOKEN_NIL, TOKEN_STRING,
-            TOKEN_NUMBER))
-    return arrput_getp(
-        parser->expressions,
-        ((Expr){.type = EXPR_LITERAL,
-                .value = {.literal = previous(
-                              parser)}})); // previous as match advances
-
-  if (match(parser, 1, TOKEN_LEFT_PAREN)) {
-    Expr *right = expression(parser);
+  if (match(parser, LITERALS)) {
+    TokenId literal = (TokenId)(parser->index - 1); // previous as match advances
+    return new_expr(parser, (Expr){.type = EXPR_LITERAL,
+                                   .value = {.literal = literal}});
+  }
+
+  if (match(parser, TOKEN_SET(TOKEN_LEFT_PAREN))) {
+    ExprId right = expression(parser);
     if (advance(parser).type != TOKEN_RIGHT_PAREN) {
-      ast_error("Expected ')' after expression.");
-      exit(AST_EXIT_FAILURE);
+      report_error(parser->errors, "Expected ')' after expression.");
+      longjmp(*parser->bail, 1);
     };
-    return arrput_getp(parser->expressions,
-                       ((Expr){.type = EXPR_GROUPING,
-                               .value = {.grouping = {.expression = right}}}));
+    return new_expr(parser,
+                    (Expr){.type = EXPR_GROUPING,
+                           .value = {.grouping = {.expression = right}}});
   } else {
-    ast_error(
-        "Unreachable parsing state while parsing primary. Failed on token: ");
-    Token token = peek(parser);
-    debug_token(&token);
-    exit(AST_EXIT_FAILURE);
+    report_error(parser->errors,
+                 "Unreachable parsing state while parsing primary. Failed on "
+                 "token: %s",
+                 TOKEN_REPRESENTATIONS[peek_type(parser)].name);
+    longjmp(*parser->bail, 1);
   }
 }
 
-Parser parse(Lexer *lexer) {
-  Parser parser = {.current = &lexer->tokens[0],
-                   .n_tokens = arrlenu(&lexer->tokens),
-                   .source_filename = lexer->source_filename,
+// Syntax errors unwind to here. The parser lives in the caller's frame, so
+// its state is still valid after the jump.
+static bool parse_root(Parser *parser) {
+  jmp_buf bail;
+  parser->bail = &bail;
+  if (setjmp(bail) != 0)
+    return false;
+  parser->root = expression(parser);
+  return true;
+}
 
-                   .tokens = lexer->tokens,
-                   .expressions = NULL,
+// On a syntax error the error is reported to `errors` (stderr when NULL) and
+// `had_error` set, with no root. The parser takes ownership of `tokens`.
+Parser parse_tokens(const char *filename, TokenStream tokens,
+                    Output *errors) {
+  ASSERT(stream_length(&tokens) < EXPR_NONE,
+         "Token indices don't fit in 32 bits");
+  Parser parser = {.index = 0,
+                   .source_filename = filename,
+
+                   .tokens = tokens,
+                   .nodes = NULL,
 
                    .finished = false,
                    .had_error = false,
+                   .errors = errors,
 
-                   .root = NULL};
+                   .root = EXPR_NONE};
+  arrsetcap(parser.nodes, stream_length(&tokens));
 
-  parser.root = expression(&parser);
+  parser.had_error = !parse_root(&parser);
+  parser.bail = NULL;
 
   return parser;
 }
 
-void free_parser(Parser *parser) { arrfree(parser->expressions); }
+Parser parse(Lexer *lexer) {
+  return parse_tokens(lexer->source_filename, scan_token_stream(lexer),
+                      lexer->errors);
+}
+
+void free_parser(Parser *parser) {
+  arrfree(parser->nodes);
+  parser->root = EXPR_NONE;
+  free_token_stream(&parser->tokens);
+}
@@ -2,10 +2,20 @@
 #define AST_H
 
 #include "lexer.h"
+#include "utils.h"
+#include <setjmp.h>
+#include <stdint.h>
 
 #define AST_EXIT_FAILURE 2 
 
 typedef struct Expr Expr;
+typedef struct Parser Parser;
+
+// Nodes refer to each other by their absolute index in `Parser.nodes` and to
+// tokens by their index in `Parser.tokens`, which keeps an `Expr` at 16 bytes.
+typedef uint32_t ExprId;
+typedef uint32_t TokenId;
+#define EXPR_NONE UINT32_MAX
 
 typedef enum {
     EXPR_LITERAL,
@@ -15,22 +25,22 @@ typedef enum {
 } ExprType;
 
 typedef struct {
-    Token op;        // "-" or "!"
-    Expr* right;
+    TokenId op;      // "-" or "!"
+    ExprId right;
 } UnaryExpr;
 
 typedef struct {
-    Expr* left;
-    Token op;        // "+", "-", "*", "/", etc.
-    Expr* right;
+    ExprId left;
+    TokenId op;      // "+", "-", "*", "/", etc.
+    ExprId right;
 } BinaryExpr;
 
 typedef struct {
-    Expr* expression;
+    ExprId expression;
 } GroupingExpr;
 
 typedef union {
-    Token literal;
+    TokenId literal;
     UnaryExpr unary;
     BinaryExpr binary;
     GroupingExpr grouping;
@@ -41,33 +51,31 @@ struct Expr {
     ExprValue value;
 };
 
-typedef struct ExprVisitor {
-    void* (*visit_literal)(struct ExprVisitor*, Token*);
-    void* (*visit_unary)(struct ExprVisitor*, UnaryExpr*);
-    void* (*visit_binary)(struct ExprVisitor*, BinaryExpr*);
-    void* (*visit_grouping)(struct ExprVisitor*, GroupingExpr*);
-} ExprVisitor;
-
-void* expr_accept(Expr* expr, ExprVisitor* visitor);
-
-extern const ExprVisitor AstPrinter;
-
-typedef struct {
-  Token* current;
+struct Parser {
   size_t index;
-  size_t n_tokens;
   const char* source_filename;
 
-  Token* tokens;  // Vec<Token>
-  Expr* expressions; // Vec<Expr>
+  TokenStream tokens;
+  // Vec<Expr>, in post-order: every subtree is contiguous and ends with its
+  // root, right after its last child, so passes over the whole tree can scan
+  // it instead of recursing. There is never more than a node per token, so
+  // room for them all is reserved up front.
+  Expr* nodes;
 
   // Runtime helpful flags
   bool finished;
   bool had_error;
- 
-  Expr* root;
-} Parser;
+  jmp_buf* bail; // where syntax errors unwind to while parsing
+  Output* errors; // where syntax errors are reported, stderr when NULL
+
+  ExprId root;
+};
+
+// Prints the tree of a successful parse as S-expressions to `out`.
+void print_ast(const Parser* parser, Output* out);
 
 Parser parse(Lexer* lexer);
+Parser parse_tokens(const char* filename, TokenStream tokens,
+                    Output* errors);
 void free_parser(Parser* parser);
 #endif  // AST_H
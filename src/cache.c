@@ -0,0 +1,362 @@
+#include "cache.h"
+#include "utils.h"
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Entry layout, every section 8 byte aligned:
+//   ParseCacheHeader
+//   uint8_t  types[token_count]
+//   uint32_t offsets[token_count]
+//   uint32_t payloads[token_count]
+//   double   numbers[number_count]
+//   CachedSymbol symbols[symbol_count]
+//   CachedString strings[string_count]
+//   CachedExpr expressions[expression_count]
+typedef struct {
+  uint32_t offset; // of the name in the source
+  uint32_t length;
+} CachedSymbol;
+
+// The stream's `strings`, which are decoded from the source again on load.
+typedef struct {
+  uint32_t offset; // of the literal's contents in the source
+  uint32_t length; // of the contents as written
+} CachedString;
+
+// Tokens and children are indices, the expressions in post-order.
+typedef struct {
+  uint32_t type;  // ExprType
+  uint32_t token; // literal or operator
+  uint32_t left;
+  uint32_t right; // also the grouped expression
+} CachedExpr;
+#define CACHED_NONE UINT32_MAX
+
+#define ALIGN8(SIZE) (((SIZE) + 7) & ~(size_t)7)
+
+static char *cache_path(const char *directory, uint64_t hash,
+                        const char *suffix) {
+  size_t size = strlen(directory) + 64;
+  char *path = malloc(size);
+  if (path == NULL) {
+    fprintf(stderr, ERROR ": memory allocation for cache path failed\n");
+    exit(LEXER_EXIT_FAILURE);
+  }
+  snprintf(path, size, "%s/%016llx%s", directory, (unsigned long long)hash,
+           suffix);
+  return path;
+}
+
+static size_t cache_size(const ParseCacheHeader *header) {
+  return sizeof(ParseCacheHeader) + ALIGN8(header->token_count) +
+         2 * ALIGN8(header->token_count * sizeof(uint32_t)) +
+         header->number_count * sizeof(double) +
+         header->symbol_count * sizeof(CachedSymbol) +
+         header->string_count * sizeof(CachedString) +
+         header->expression_count * sizeof(CachedExpr);
+}
+
+// Nodes are written in the parser's order, which already has children before
+// their parent.
+static void output_expressions(Output *out, const Parser *parser) {
+  for (size_t i = 0; i < arrlenu(parser->nodes); i++) {
+    const Expr *expr = &parser->nodes[i];
+    CachedExpr cached = {.type = expr->type,
+                         .token = CACHED_NONE,
+                         .left = CACHED_NONE,
+                         .right = CACHED_NONE};
+    switch (expr->type) {
+    case EXPR_LITERAL:
+      cached.token = expr->value.literal;
+      break;
+    case EXPR_UNARY:
+      cached.token = expr->value.unary.op;
+      cached.right = expr->value.unary.right;
+      break;
+    case EXPR_BINARY:
+      cached.token = expr->value.binary.op;
+      cached.left = expr->value.binary.left;
+      cached.right = expr->value.binary.right;
+      break;
+    case EXPR_GROUPING:
+      cached.right = expr->value.grouping.expression;
+      break;
+    }
+    output_write(out, (const char *)&cached, sizeof(cached));
+  }
+}
+
+static void output_padding(Output *out, size_t written) {
+  static const char zeros[8] = {0};
+  output_write(out, zeros, ALIGN8(written) - written);
+}
+
+void store_parse_cache(const char *directory, const Lexer *lexer,
+                       const Parser *parser) {
+  const TokenStream *stream = &parser->tokens;
+  const SymbolTable *symbols = lexer->symbols;
+  ParseCacheHeader header = {
+      .magic = PARSE_CACHE_MAGIC,
+      .version = PARSE_CACHE_VERSION,
+      .byte_order = PARSE_CACHE_BYTE_ORDER,
+      .source_hash = hash_source(lexer->source, lexer->source_len),
+      .source_len = lexer->source_len,
+      .token_count = stream_length(stream),
+      .number_count = arrlenu(stream->numbers),
+      .symbol_count = arrlenu(symbols->names),
+      .string_count = arrlenu(stream->strings),
+      .expression_count = arrlenu(parser->nodes),
+      .root = parser->root};
+
+  mkdir(directory, 0777);
+  // Written aside and renamed into place so readers never see partial
+  // entries.
+  char *path = cache_path(directory, header.source_hash, ".ast");
+  // Unique per process and call, for batch runs storing the same source.
+  static unsigned long stores = 0;
+  char suffix[48];
+  snprintf(suffix, sizeof(suffix), ".%ld.%lu.tmp", (long)getpid(),
+           __atomic_fetch_add(&stores, 1, __ATOMIC_RELAXED));
+  char *temporary = cache_path(directory, header.source_hash, suffix);
+  FILE *file = fopen(temporary, "wb");
+  if (file == NULL) {
+    report_error(lexer->errors, "couldn't write cache entry [%s]", temporary);
+    goto defer;
+  }
+
+  Output out = {.sink = file};
+  size_t count = header.token_count;
+  output_write(&out, (const char *)&header, sizeof(header));
+  output_write(&out, (const char *)stream->types, count);
+  output_padding(&out, count);
+  output_write(&out, (const char *)stream->offsets, count * sizeof(uint32_t));
+  output_padding(&out, count * sizeof(uint32_t));
+  output_write(&out, (const char *)stream->payloads, count * sizeof(uint32_t));
+  output_padding(&out, count * sizeof(uint32_t));
+  output_write(&out, (const char *)stream->numbers,
+               header.number_count * sizeof(double));
+  for (size_t id = 0; id < header.symbol_count; id++) {
+    CachedSymbol symbol = {
+        .offset = (uint32_t)(symbols->names[id].start - lexer->source),
+        .length = (uint32_t)symbols->names[id].length};
+    output_write(&out, (const char *)&symbol, sizeof(symbol));
+  }
+  const char *end = lexer->source + lexer->source_len;
+  for (size_t i = 0; i < count; i++) {
+    if (stream->types[i] != TOKEN_STRING ||
+        !(stream->payloads[i] & STREAM_STRING_INDEX))
+      continue;
+    const char *contents = lexer->source + stream->offsets[i];
+    CachedString string = {
+        .offset = stream->offsets[i],
+        .length = (uint32_t)(string_literal_end(contents, end) - contents)};
+    output_write(&out, (const char *)&string, sizeof(string));
+  }
+  output_expressions(&out, parser);
+  free_output(&out);
+
+  bool failed = ferror(file);
+  if (fclose(file) != 0 || failed || rename(temporary, path) != 0) {
+    report_error(lexer->errors, "couldn't write cache entry [%s]", path);
+    unlink(temporary);
+  }
+
+defer:
+  free(path);
+  free(temporary);
+}
+
+static bool check_tokens(const ParseCacheHeader *header, const uint8_t *types,
+                         const uint32_t *offsets, const uint32_t *payloads) {
+  for (size_t i = 0; i < header->token_count; i++) {
+    // EOF starts just past the source's NUL sentinel.
+    if (types[i] >= TOKEN_TYPE_LEN || offsets[i] > header->source_len + 1)
+      return false;
+    switch (types[i]) {
+    case TOKEN_IDENTIFIER:
+      if (payloads[i] >= header->symbol_count)
+        return false;
+      break;
+    case TOKEN_STRING:
+      if (payloads[i] & STREAM_STRING_INDEX) {
+        if ((payloads[i] & ~STREAM_STRING_INDEX) >= header->string_count)
+          return false;
+      } else if (offsets[i] > header->source_len ||
+                 payloads[i] > header->source_len - offsets[i]) {
+        return false;
+      }
+      break;
+    case TOKEN_NUMBER:
+      if (payloads[i] >= header->number_count)
+        return false;
+      break;
+    default:
+      break;
+    }
+  }
+  return true;
+}
+
+// The nodes must be a tree in post-order, as the parser lays them out: each
+// node's last child right before it, the one before that right before the
+// last child's subtree, and the root last of all.
+static bool check_expressions(const ParseCacheHeader *header,
+                              const CachedExpr *expressions) {
+  uint32_t *sizes = NULL; // Vec<uint32_t>, nodes in each subtree
+  arrsetlen(sizes, header->expression_count);
+  bool valid = header->expression_count > 0 &&
+               header->root == header->expression_count - 1;
+  for (uint32_t i = 0; valid && i < header->expression_count; i++) {
+    const CachedExpr *expr = &expressions[i];
+    bool has_token = expr->type != EXPR_GROUPING;
+    bool has_left = expr->type == EXPR_BINARY;
+    bool has_right = expr->type != EXPR_LITERAL;
+    sizes[i] = 1;
+    if (expr->type > EXPR_GROUPING ||
+        (has_token && expr->token >= header->token_count) ||
+        (has_right && (i == 0 || expr->right != i - 1))) {
+      valid = false;
+      break;
+    }
+    if (has_right)
+      sizes[i] += sizes[expr->right];
+    if (has_left) {
+      uint32_t left_root = i - sizes[expr->right];
+      if (left_root == 0 || expr->left != left_root - 1) {
+        valid = false;
+        break;
+      }
+      sizes[i] += sizes[expr->left];
+    }
+  }
+  valid = valid && sizes[header->root] == header->expression_count;
+  arrfree(sizes);
+  return valid;
+}
+
+static Expr load_expr(const CachedExpr *cached) {
+  switch ((ExprType)cached->type) {
+  case EXPR_LITERAL:
+    return (Expr){.type = EXPR_LITERAL, .value = {.literal = cached->token}};
+  case EXPR_UNARY:
+    return (Expr){
+        .type = EXPR_UNARY,
+        .value = {.unary = {.op = cached->token, .right = cached->right}}};
+  case EXPR_BINARY:
+    return (Expr){.type = EXPR_BINARY,
+                  .value = {.binary = {.left = cached->left,
+                                       .op = cached->token,
+                                       .right = cached->right}}};
+  case EXPR_GROUPING:
+    break;
+  }
+  return (Expr){.type = EXPR_GROUPING,
+                .value = {.grouping = {.expression = cached->right}}};
+}
+
+bool load_parse_cache(const char *directory, Lexer *lexer, Parser *parser) {
+  ASSERT(lexer->symbols != NULL && arrlenu(lexer->symbols->names) == 0,
+         "Parse cache loaded into a lexer that already lexed");
+  uint64_t hash = hash_source(lexer->source, lexer->source_len);
+  char *path = cache_path(directory, hash, ".ast");
+  size_t length = 0;
+  const char *contents = map_file_contents(path, &length);
+  free(path);
+  if (contents == NULL)
+    return false;
+
+  bool hit = false;
+  const ParseCacheHeader *header = (const ParseCacheHeader *)contents;
+  if (length < sizeof(*header) ||
+      memcmp(header->magic, PARSE_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != PARSE_CACHE_VERSION ||
+      header->byte_order != PARSE_CACHE_BYTE_ORDER ||
+      header->source_hash != hash || header->source_len != lexer->source_len ||
+      header->token_count > UINT32_MAX ||
+      header->expression_count > UINT32_MAX ||
+      header->number_count > header->token_count ||
+      header->symbol_count > header->token_count ||
+      header->string_count > header->token_count ||
+      cache_size(header) != length)
+    goto defer;
+
+  size_t count = header->token_count;
+  const char *section = contents + sizeof(*header);
+  const uint8_t *types = (const uint8_t *)section;
+  section += ALIGN8(count);
+  const uint32_t *offsets = (const uint32_t *)section;
+  section += ALIGN8(count * sizeof(uint32_t));
+  const uint32_t *payloads = (const uint32_t *)section;
+  section += ALIGN8(count * sizeof(uint32_t));
+  const double *numbers = (const double *)section;
+  section += header->number_count * sizeof(double);
+  const CachedSymbol *symbols = (const CachedSymbol *)section;
+  section += header->symbol_count * sizeof(CachedSymbol);
+  const CachedString *strings = (const CachedString *)section;
+  section += header->string_count * sizeof(CachedString);
+  const CachedExpr *expressions = (const CachedExpr *)section;
+
+  if (!check_tokens(header, types, offsets, payloads) ||
+      !check_expressions(header, expressions))
+    goto defer;
+
+  // Interning the names in order hands out the same ids again.
+  for (size_t id = 0; id < header->symbol_count; id++) {
+    if (symbols[id].offset > lexer->source_len ||
+        symbols[id].length > lexer->source_len - symbols[id].offset ||
+        intern_symbol(lexer->symbols, lexer->source + symbols[id].offset,
+                      symbols[id].length) != id) {
+      free_symbol_table(lexer->symbols);
+      goto defer;
+    }
+  }
+
+  TokenStream stream = {.source = lexer->source, .symbols = lexer->symbols};
+  arrsetlen(stream.types, count);
+  memcpy(stream.types, types, count);
+  arrsetlen(stream.offsets, count);
+  memcpy(stream.offsets, offsets, count * sizeof(uint32_t));
+  arrsetlen(stream.payloads, count);
+  memcpy(stream.payloads, payloads, count * sizeof(uint32_t));
+  if (header->number_count > 0) {
+    arrsetlen(stream.numbers, header->number_count);
+    memcpy(stream.numbers, numbers, header->number_count * sizeof(double));
+  }
+  for (size_t i = 0; i < header->string_count; i++) {
+    if (strings[i].offset > lexer->source_len ||
+        strings[i].length > lexer->source_len - strings[i].offset)
+      goto mismatch;
+    const char *contents = lexer->source + strings[i].offset;
+    char *decoded = arena_alloc(lexer->strings, strings[i].length, 1);
+    String string = {.start = decoded};
+    if (decode_escapes(contents, contents + strings[i].length, decoded,
+                       &string.length) != NULL)
+      goto mismatch;
+    arrput(stream.strings, string);
+  }
+
+  *parser = (Parser){.index = 0,
+                     .source_filename = lexer->source_filename,
+                     .tokens = stream,
+                     .nodes = NULL,
+                     .finished = false,
+                     .had_error = false,
+                     .errors = lexer->errors,
+                     .root = (ExprId)header->root};
+  arrsetlen(parser->nodes, header->expression_count);
+  for (size_t i = 0; i < header->expression_count; i++)
+    parser->nodes[i] = load_expr(&expressions[i]);
+
+  lexer->current = lexer->source + lexer->source_len;
+  lexer->finished = true;
+  hit = true;
+  goto defer;
+
+mismatch:
+  free_token_stream(&stream);
+  free_symbol_table(lexer->symbols);
+defer:
+  unmap_file_contents(contents, length);
+  return hit;
+}
@@ -0,0 +1,34 @@
+#ifndef CACHE_H
+#define CACHE_H
+#include "ast.h"
+#include "lexer.h"
+
+// On-disk parse cache: the token stream, symbols and expressions of a parsed
+// source, filed under a hash of its contents so unchanged sources can skip
+// lexing and parsing altogether. Entries are in host byte order and carry a
+// version; anything that doesn't check out is treated as a miss.
+#define PARSE_CACHE_MAGIC "CLOXAST"
+#define PARSE_CACHE_VERSION 2
+#define PARSE_CACHE_BYTE_ORDER 0x01020304u
+
+typedef struct {
+  char magic[8];       // PARSE_CACHE_MAGIC, NUL padded
+  uint32_t version;    // PARSE_CACHE_VERSION
+  uint32_t byte_order; // PARSE_CACHE_BYTE_ORDER as seen by the writer
+  uint64_t source_hash;
+  uint64_t source_len;
+  uint64_t token_count;
+  uint64_t number_count;
+  uint64_t symbol_count;
+  uint64_t string_count; // string literals held apart from the source
+  uint64_t expression_count;
+  uint64_t root; // index into the expressions
+} ParseCacheHeader;
+
+// Fills `parser` (and the lexer's symbols) from `directory` when it holds an
+// entry for the lexer's source. `lexer` must be fresh from `init_lexer`.
+bool load_parse_cache(const char *directory, Lexer *lexer, Parser *parser);
+// Best effort: failures are reported but otherwise ignored.
+void store_parse_cache(const char *directory, const Lexer *lexer,
+                       const Parser *parser);
+#endif // CACHE_H
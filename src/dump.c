@@ -0,0 +1,197 @@
+#include "dump.h"
+#include <string.h>
+
+void write_token_dump_header(Output *out) {
+  TokenDumpHeader header = {.magic = TOKEN_DUMP_MAGIC,
+                            .version = TOKEN_DUMP_VERSION,
+                            .byte_order = TOKEN_DUMP_BYTE_ORDER};
+  output_write(out, (const char *)&header, sizeof(header));
+}
+
+void write_token_dump_trailer(Output *out, const SourceHash *hash) {
+  TokenDumpTrailer trailer = {.source_len = hash->length,
+                              .source_hash = source_hash_value(hash)};
+  output_write(out, (const char *)&trailer, sizeof(trailer));
+}
+
+void write_token_record(Output *out, const Lexer *lexer, const Token *token) {
+  uint64_t offset = lexer->window_offset + (token->start - lexer->source);
+  TokenRecord record = {.position = offset << 8 | (uint8_t)token->type};
+  switch (token->type) {
+  case TOKEN_IDENTIFIER:
+    record.payload.length = token->value.as.identifier_value.length;
+    break;
+  case TOKEN_STRING:
+    record.payload.length = token->value.as.string_value.length;
+    // Decoded strings record their source slice, to be decoded again.
+    if (token->value.as.string_value.start != token->start) {
+      const char *end = lexer->source + lexer->source_len;
+      record.payload.length = TOKEN_RECORD_ESCAPED |
+                              (string_literal_end(token->start, end) -
+                               token->start);
+    }
+    break;
+  case TOKEN_NUMBER:
+    record.payload.number = token->value.as.number_value;
+    break;
+  default:
+    break;
+  }
+  output_write(out, (const char *)&record, sizeof(record));
+}
+
+static bool check_token_dump(const char *filename, TokenDump *dump) {
+  const TokenDumpHeader *header = (const TokenDumpHeader *)dump->contents;
+  if (dump->contents_len < sizeof(*header) + sizeof(TokenDumpTrailer) ||
+      memcmp(header->magic, TOKEN_DUMP_MAGIC, sizeof(header->magic)) != 0) {
+    fprintf(stderr, ERROR ": %s is not a token dump\n", filename);
+    return false;
+  }
+  if (header->version != TOKEN_DUMP_VERSION ||
+      header->byte_order != TOKEN_DUMP_BYTE_ORDER) {
+    fprintf(stderr, ERROR ": token dump %s has an unsupported version\n",
+            filename);
+    return false;
+  }
+  if ((dump->contents_len - sizeof(*header) - sizeof(TokenDumpTrailer)) %
+          sizeof(TokenRecord) !=
+      0) {
+    fprintf(stderr, ERROR ": token dump %s is truncated\n", filename);
+    return false;
+  }
+  TokenDumpTrailer trailer;
+  memcpy(&trailer, dump->contents + dump->contents_len - sizeof(trailer),
+         sizeof(trailer));
+  if (trailer.source_len != dump->source_len ||
+      trailer.source_hash != hash_source(dump->source, dump->source_len)) {
+    fprintf(stderr, ERROR ": token dump %s was made from a different source\n",
+            filename);
+    return false;
+  }
+
+  for (size_t i = 0; i < dump->count; i++) {
+    const TokenRecord *record = &dump->records[i];
+    uint64_t offset = record->position >> 8;
+    uint8_t type = record->position & 0xff;
+    uint64_t length = 0;
+    if (type == TOKEN_IDENTIFIER || type == TOKEN_STRING)
+      length = record->payload.length;
+    bool escaped = type == TOKEN_STRING && (length & TOKEN_RECORD_ESCAPED);
+    length &= ~TOKEN_RECORD_ESCAPED;
+    // EOF starts just past the source's NUL sentinel.
+    if (type >= TOKEN_TYPE_LEN || offset > dump->source_len + 1 ||
+        length > dump->source_len + 1 - offset)
+      goto mismatch;
+
+    if (escaped) {
+      const char *start = dump->source + offset;
+      String decoded = {.start = arena_alloc(&dump->strings, length, 1)};
+      if (decode_escapes(start, start + length, (char *)decoded.start,
+                         &decoded.length) != NULL)
+        goto mismatch;
+      arrput(dump->escaped, i);
+      arrput(dump->decoded, decoded);
+    }
+  }
+  return true;
+
+mismatch:
+  fprintf(stderr, ERROR ": token dump %s doesn't match its source\n",
+          filename);
+  return false;
+}
+
+// Records are used in place: the header keeps them 8 byte aligned within the
+// mapping (or the heap copy for files that can't be mapped).
+bool load_token_dump(const char *filename, const char *source,
+                     size_t source_len, TokenDump *dump) {
+  size_t length = 0;
+  const char *contents = map_file_contents(filename, &length);
+  bool mapped = contents != NULL;
+  if (!mapped)
+    contents = read_file_contents(filename, &length);
+  if (contents == NULL) {
+    fprintf(stderr, ERROR ": couldn't read token dump %s\n", filename);
+    return false;
+  }
+
+  *dump = (TokenDump){
+      .contents = contents,
+      .contents_len = length,
+      .contents_mapped = mapped,
+      .records = (const TokenRecord *)(contents + sizeof(TokenDumpHeader)),
+      .count = length < sizeof(TokenDumpHeader) + sizeof(TokenDumpTrailer)
+                   ? 0
+                   : (length - sizeof(TokenDumpHeader) -
+                      sizeof(TokenDumpTrailer)) /
+                         sizeof(TokenRecord),
+      .source = source,
+      .source_len = source_len};
+
+  if (!check_token_dump(filename, dump)) {
+    free_token_dump(dump);
+    return false;
+  }
+  return true;
+}
+
+void free_token_dump(TokenDump *dump) {
+  if (dump->contents_mapped)
+    unmap_file_contents(dump->contents, dump->contents_len);
+  else
+    free((char *)dump->contents);
+  arrfree(dump->escaped);
+  arrfree(dump->decoded);
+  free_arena(&dump->strings);
+  *dump = (TokenDump){0};
+}
+
+Token dump_token(const TokenDump *dump, size_t index) {
+  if (index >= dump->count)
+    return (Token){.type = TOKEN_EOF,
+                   .symbol = SYMBOL_NONE,
+                   .value = {.type = TYPE_NULL}};
+
+  const TokenRecord *record = &dump->records[index];
+  TokenType type = (TokenType)(record->position & 0xff);
+  const char *start = dump->source + (record->position >> 8);
+  Value value = {.type = TYPE_NULL};
+  switch (type) {
+  case TOKEN_IDENTIFIER:
+    value = (Value){.type = TYPE_IDENTIFIER,
+                    .as.identifier_value = {.start = start,
+                                            .length = record->payload.length}};
+    break;
+  case TOKEN_STRING:
+    value = (Value){.type = TYPE_STRING,
+                    .as.string_value = {.start = start,
+                                        .length = record->payload.length}};
+    if (record->payload.length & TOKEN_RECORD_ESCAPED) {
+      size_t low = 0, high = arrlenu(dump->escaped);
+      while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (dump->escaped[mid] < index)
+          low = mid + 1;
+        else
+          high = mid;
+      }
+      value.as.string_value = dump->decoded[low];
+    }
+    break;
+  case TOKEN_NUMBER:
+    value = (Value){.type = TYPE_NUMBER,
+                    .as.number_value = record->payload.number};
+    break;
+  case TOKEN_TRUE:
+    value = (Value){.type = TYPE_BOOL, .as.bool_value = true};
+    break;
+  case TOKEN_FALSE:
+    value = (Value){.type = TYPE_BOOL, .as.bool_value = false};
+    break;
+  default:
+    break;
+  }
+
+  return (Token){
+      .type = type, .symbol = SYMBOL_NONE, .start = start, .value = value};
+}
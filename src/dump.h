@@ -0,0 +1,67 @@
+#ifndef DUMP_H
+#define DUMP_H
+#include "lexer.h"
+#include "utils.h"
+#include <stdint.h>
+
+// Binary token dumps, as written by `clox tokenize --format=bin`: a header,
+// one fixed size record per token and a trailer, in host byte order. The
+// trailer identifies the source, so a dump can be written while the source
+// is still being read. The loader maps a dump and rebuilds `Token`s over the
+// original source without lexing it again, after checking that the source
+// is the one it was made from.
+#define TOKEN_DUMP_MAGIC "CLOXTOK"
+#define TOKEN_DUMP_VERSION 4
+#define TOKEN_DUMP_BYTE_ORDER 0x01020304u
+
+typedef struct {
+  char magic[8];       // TOKEN_DUMP_MAGIC, NUL padded
+  uint32_t version;    // TOKEN_DUMP_VERSION
+  uint32_t byte_order; // TOKEN_DUMP_BYTE_ORDER as seen by the writer
+} TokenDumpHeader;
+
+typedef struct {
+  uint64_t source_len;
+  uint64_t source_hash; // `hash_source` of the whole source
+} TokenDumpTrailer;
+
+typedef struct {
+  uint64_t position; // offset of `Token.start` in the source << 8 | TokenType
+  union {
+    uint64_t length; // slice length of identifiers and strings, strings
+                     // with escapes are flagged TOKEN_RECORD_ESCAPED
+    double number;   // decoded value of numbers
+  } payload;
+} TokenRecord;
+#define TOKEN_RECORD_ESCAPED (1ull << 63)
+
+// A loaded dump. `source` is the text the dump was made from and must
+// outlive it; every record is checked to lie within it when loading.
+typedef struct {
+  const char *contents;
+  size_t contents_len;
+  bool contents_mapped;
+  const TokenRecord *records;
+  size_t count;
+  const char *source;
+  size_t source_len;
+  // Strings with escapes are decoded when loading.
+  size_t *escaped;  // Vec<size_t>, their records in ascending order
+  String *decoded;  // Vec<String>, their text in `strings`
+  Arena strings;
+} TokenDump;
+
+void write_token_dump_header(Output *out);
+// `token` must come from `lexer`, which may be a streaming lexer.
+void write_token_record(Output *out, const Lexer *lexer, const Token *token);
+// `hash` has been fed the whole source.
+void write_token_dump_trailer(Output *out, const SourceHash *hash);
+
+// Returns false (after reporting why) when `filename` isn't a dump of
+// `source`.
+bool load_token_dump(const char *filename, const char *source,
+                     size_t source_len, TokenDump *dump);
+void free_token_dump(TokenDump *dump);
+// Reading past the last record yields EOF.
+Token dump_token(const TokenDump *dump, size_t index);
+#endif // DUMP_H
@@ -1,11 +1,23 @@
 #include "lexer.h"
 #include "utils.h"
-#include <ctype.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+// The SSSE3 code is compiled for its own target and picked at run time, so
+// every x86 build has it whatever -march it was built for.
+#if defined(__SSE2__) && defined(__GNUC__)
+#define LEXER_SSSE3 1
+#define SSSE3_TARGET __attribute__((target("ssse3")))
+#include <tmmintrin.h>
+#endif
 
 // Convenience mappings.
 const TokenRepr TOKEN_REPRESENTATIONS[TOKEN_TYPE_LEN] = {
@@ -52,40 +64,160 @@ const TokenRepr TOKEN_REPRESENTATIONS[TOKEN_TYPE_LEN] = {
     [TOKEN_EOF] = {.name = "EOF", .symbol = "EOS"},
 };
 
+// Compare a candidate identifier against the keyword spelling held in
+// TOKEN_REPRESENTATIONS, the single source of truth for keyword text.
+static inline TokenType check_keyword(const char *start, uint32_t length,
+                                      TokenType candidate) {
+  const char *keyword = TOKEN_REPRESENTATIONS[candidate].symbol;
+  if (memcmp(start, keyword, length) == 0 && keyword[length] == '\0')
+    return candidate;
+  return TOKEN_IDENTIFIER;
+}
+
+// Keyword recognition: dispatch on length and first character so that any
+// identifier costs at most one string compare against a single candidate.
 TokenType identifier_type(const char *start, uint32_t length) {
-  for (size_t i = 0; i < (sizeof(KEYWORDS) / sizeof(KEYWORDS[0])); ++i) {
-    const char *keyword = KEYWORDS[i].keyword;
-    size_t kw_len = strlen(keyword);
-    if (length == kw_len && strncmp(start, keyword, length) == 0) {
-      return KEYWORDS[i].type;
+  switch (length) {
+  case 2:
+    switch (start[0]) {
+    case 'i':
+      return check_keyword(start, length, TOKEN_IF);
+    case 'o':
+      return check_keyword(start, length, TOKEN_OR);
+    }
+    break;
+  case 3:
+    switch (start[0]) {
+    case 'a':
+      return check_keyword(start, length, TOKEN_AND);
+    case 'f':
+      return check_keyword(start, length,
+                           start[1] == 'o' ? TOKEN_FOR : TOKEN_FUN);
+    case 'n':
+      return check_keyword(start, length, TOKEN_NIL);
+    case 'v':
+      return check_keyword(start, length, TOKEN_VAR);
+    }
+    break;
+  case 4:
+    switch (start[0]) {
+    case 'e':
+      return check_keyword(start, length, TOKEN_ELSE);
+    case 't':
+      return check_keyword(start, length,
+                           start[1] == 'h' ? TOKEN_THIS : TOKEN_TRUE);
+    }
+    break;
+  case 5:
+    switch (start[0]) {
+    case 'c':
+      return check_keyword(start, length, TOKEN_CLASS);
+    case 'f':
+      return check_keyword(start, length, TOKEN_FALSE);
+    case 'p':
+      return check_keyword(start, length, TOKEN_PRINT);
+    case 's':
+      return check_keyword(start, length, TOKEN_SUPER);
+    case 'w':
+      return check_keyword(start, length, TOKEN_WHILE);
     }
+    break;
+  case 6:
+    if (start[0] == 'r')
+      return check_keyword(start, length, TOKEN_RETURN);
+    break;
   }
   return TOKEN_IDENTIFIER;
 }
 
-Lexer init_lexer(const char *filename, const char *source) {
-  size_t source_len = strlen(source);
+static Lexer new_lexer(const char *filename, const char *source,
+                       size_t source_len) {
+  ASSERT(source[source_len] == '\0', "Lexer source has no NUL sentinel");
   Token *tokens = NULL;
   return (Lexer){.current = source,
                  .source = source,
                  .source_filename = filename,
                  .source_len = source_len,
                  .tokens = tokens,
-                 .line = 0,
-                 .line_offset = 0};
+                 .symbols = NULL,
+                 .line_starts = NULL,
+                 .window_line = 0,
+                 .window_column = 0,
+                 .window_offset = 0};
+}
+
+static uint32_t *index_lines(const char *source, size_t length);
+
+// `source` must be followed by a NUL sentinel at `source[source_len]`.
+// Offsets are 32 bit: larger inputs have to go through `init_stream_lexer`.
+Lexer init_lexer(const char *filename, const char *source, size_t source_len) {
+  if (source_len >= UINT32_MAX) {
+    fprintf(stderr, ERROR ": file %s is too large to lex in memory\n",
+            filename);
+    exit(LEXER_EXIT_FAILURE);
+  }
+
+  Lexer lexer = new_lexer(filename, source, source_len);
+  lexer.line_starts = index_lines(source, source_len);
+  lexer.symbols = calloc(1, sizeof(SymbolTable));
+  lexer.strings = calloc(1, sizeof(Arena));
+  if (lexer.symbols == NULL || lexer.strings == NULL) {
+    fprintf(stderr, ERROR ": memory allocation for file %s failed\n", filename);
+    exit(LEXER_EXIT_FAILURE);
+  }
+  return lexer;
+}
+
+static void refill_window(Lexer *lexer);
+
+// The lexer owns `stream` and closes it in `free_lexer`. `hash`, if not NULL,
+// is fed the whole stream as it is read.
+Lexer init_stream_lexer(const char *filename, FILE *stream, SourceHash *hash) {
+  char *window = malloc(LEXER_STREAM_CHUNK + 1);
+  Arena *strings = calloc(1, sizeof(Arena));
+  if (window == NULL || strings == NULL) {
+    fprintf(stderr, ERROR ": memory allocation for file %s failed\n", filename);
+    exit(LEXER_EXIT_FAILURE);
+  }
+  window[0] = '\0';
+
+  Lexer lexer = new_lexer(filename, window, 0);
+  lexer.stream = stream;
+  lexer.stream_hash = hash;
+  lexer.strings = strings;
+  lexer.window_capacity = LEXER_STREAM_CHUNK + 1;
+  lexer.partial = true;
+  refill_window(&lexer);
+  return lexer;
 }
 
 // Free the lexer **AND THE TOKENS** array.
 void free_lexer(Lexer *lexer) {
   lexer->current = NULL;
-  free((void *)lexer->source);
+  if (lexer->source_mapped)
+    unmap_file_contents(lexer->source, lexer->source_len);
+  else
+    free((void *)lexer->source);
   lexer->source = NULL;
+  if (lexer->stream != NULL)
+    fclose(lexer->stream);
+  lexer->stream = NULL;
   lexer->source_len = 0;
-  lexer->line = 0;
-  lexer->line_offset = 0;
+  arrfree(lexer->line_starts);
+  lexer->line_starts = NULL;
 
   arrfree(lexer->tokens);
   lexer->tokens = NULL;
+  if (lexer->symbols != NULL) {
+    free_symbol_table(lexer->symbols);
+    free(lexer->symbols);
+  }
+  lexer->symbols = NULL;
+  if (lexer->strings != NULL) {
+    free_arena(lexer->strings);
+    free(lexer->strings);
+  }
+  lexer->strings = NULL;
 
   ASSERT(lexer->current == NULL,
          "Lexer `current` is not a null pointer after free.");
@@ -95,6 +227,88 @@ void free_lexer(Lexer *lexer) {
          "Lexer `tokens` is not a null pointer after free.");
 }
 
+// Symbols
+
+static uint32_t hash_name(const char *name, size_t length) {
+  uint64_t hash = 0x9E3779B97F4A7C15ULL ^ length;
+  uint64_t word;
+  for (; length >= 8; name += 8, length -= 8) {
+    memcpy(&word, name, 8);
+    hash = (hash ^ word) * 0xBF58476D1CE4E5B9ULL;
+    hash ^= hash >> 31;
+  }
+  word = 0;
+  memcpy(&word, name, length);
+  hash = (hash ^ word) * 0x94D049BB133111EBULL;
+  hash ^= hash >> 29;
+  return (uint32_t)hash;
+}
+
+static void grow_symbol_table(SymbolTable *table) {
+  size_t capacity = table->capacity ? 2 * table->capacity : 64;
+  uint32_t *slots = calloc(capacity, sizeof(uint32_t));
+  if (slots == NULL) {
+    fprintf(stderr, ERROR ": memory allocation for symbol table failed\n");
+    exit(LEXER_EXIT_FAILURE);
+  }
+  for (size_t id = 0; id < arrlenu(table->names); id++) {
+    size_t slot = table->hashes[id] & (capacity - 1);
+    while (slots[slot] != 0)
+      slot = (slot + 1) & (capacity - 1);
+    slots[slot] = (uint32_t)id + 1;
+  }
+  free(table->slots);
+  table->slots = slots;
+  table->capacity = capacity;
+}
+
+// `hash` is `hash_name(name, length)`.
+static SymbolId intern_hashed(SymbolTable *table, const char *name,
+                              size_t length, uint32_t hash) {
+  // Keep the load factor at or below one half.
+  if (2 * (arrlenu(table->names) + 1) > table->capacity)
+    grow_symbol_table(table);
+
+  size_t slot = hash & (table->capacity - 1);
+  for (; table->slots[slot] != 0; slot = (slot + 1) & (table->capacity - 1)) {
+    SymbolId id = table->slots[slot] - 1;
+    if (table->hashes[id] == hash && table->names[id].length == length &&
+        memcmp(table->names[id].start, name, length) == 0)
+      return id;
+  }
+
+  if (table->storage != NULL) {
+    char *copy = arena_alloc(table->storage, length, 1);
+    memcpy(copy, name, length);
+    name = copy;
+  }
+  SymbolId id = (SymbolId)arrlenu(table->names);
+  arrput(table->names, ((String){.start = name, .length = length}));
+  arrput(table->hashes, hash);
+  table->slots[slot] = id + 1;
+  return id;
+}
+
+SymbolId intern_symbol(SymbolTable *table, const char *name, size_t length) {
+  return intern_hashed(table, name, length, hash_name(name, length));
+}
+
+String symbol_name(const SymbolTable *table, SymbolId symbol) {
+  ASSERT(symbol < arrlenu(table->names), "Unknown symbol");
+  return table->names[symbol];
+}
+
+void free_symbol_table(SymbolTable *table) {
+  arrfree(table->names);
+  arrfree(table->hashes);
+  free(table->slots);
+  if (table->storage != NULL) {
+    free_arena(table->storage);
+    free(table->storage);
+  }
+  *table = (SymbolTable){0};
+}
+
 // Error
 void lex_error(const char *filename, size_t line, size_t line_offset,
                const char *fmt, ...) {
@@ -106,13 +320,21 @@ void lex_error(const char *filename, size_t line, size_t line_offset,
   va_end(args);
 }
 void lex_error_with(Lexer *lexer, const char *fmt, ...) {
+  if (lexer->silent)
+    return;
+  size_t line, column;
+  lexer_position(lexer, lexer->current, &line, &column);
+  Output fallback = {.sink = stderr};
+  Output *errors = lexer->errors != NULL ? lexer->errors : &fallback;
   va_list args;
   va_start(args, fmt);
-  fprintf(stderr, ERROR ": %s:%zu:%zu ", lexer->source_filename,
-          lexer->line + 1, lexer->line_offset);
-  vfprintf(stderr, fmt, args);
-  fprintf(stderr, "\n");
+  output_format(errors, ERROR ": %s:%zu:%zu ", lexer->source_filename,
+                line + 1, column);
+  output_vformat(errors, fmt, args);
+  output_string(errors, "\n");
   va_end(args);
+  output_flush(errors);
+  free_output(&fallback);
 }
 
 // Core
@@ -135,24 +357,24 @@ static char advance(Lexer *lexer) {
   if (c == '\0') {
     lexer->finished = true;
     debug("Lexer finished");
-  } else {
-    lexer->line_offset++;
   }
 
   return c;
 }
 
 // Token constructor for simple tokens
-static Token token_at(Lexer *lexer, TokenType type, const char *start, Value value) {
+static Token token_at(TokenType type, const char *start, Value value) {
   debug("Creating new token: %s", TOKEN_REPRESENTATIONS[type].name);
-  return (Token){
-      .type = type, .line = lexer->line, .start = start, .value = value};
+  return (Token){.type = type,
+                 .symbol = SYMBOL_NONE,
+                 .start = start,
+                 .value = value};
 }
 
 // Simply make a new token with no value
 static Token newtoken(Lexer *lexer, TokenType type) {
   const char *start = lexer->current;
-  return token_at(lexer, type, start, (Value){.type = TYPE_NULL});
+  return token_at(type, start, (Value){.type = TYPE_NULL});
 }
 
 // If current token matches eat it
@@ -169,28 +391,395 @@ static bool match(Lexer *lexer, const char expected) {
   return false;
 }
 
-// Get current token
-static char peek(Lexer *lexer) {
-  if (lexer->finished)
-    return '\0';
-  debug("Peeked");
-  return *lexer->current;
+// Character traits
+//
+// One bitmask per byte so every lexer predicate is a single load and mask,
+// independent of the C locale. Bytes outside ASCII are only TRAIT_UTF8:
+// identifiers take any non-ASCII code point, which is validated separately.
+enum {
+  TRAIT_IDENT_START = 1 << 0, // letters and `_`
+  TRAIT_IDENT = 1 << 1,       // letters, digits and `_`
+  TRAIT_DIGIT = 1 << 2,
+  TRAIT_SPACE = 1 << 3, // ' ', '\t', '\n', '\v', '\f' and '\r'
+  TRAIT_NEWLINE = 1 << 4,
+  TRAIT_UTF8 = 1 << 5, // bytes of multibyte UTF-8 sequences, and invalid ones
+};
+
+static const uint8_t CHAR_TRAITS[256] = {
+    ['a' ... 'z'] = TRAIT_IDENT_START | TRAIT_IDENT,
+    ['A' ... 'Z'] = TRAIT_IDENT_START | TRAIT_IDENT,
+    ['_'] = TRAIT_IDENT_START | TRAIT_IDENT,
+    ['0' ... '9'] = TRAIT_IDENT | TRAIT_DIGIT,
+    [' '] = TRAIT_SPACE,
+    ['\t'] = TRAIT_SPACE,
+    ['\n'] = TRAIT_SPACE | TRAIT_NEWLINE,
+    ['\v'] = TRAIT_SPACE,
+    ['\f'] = TRAIT_SPACE,
+    ['\r'] = TRAIT_SPACE,
+    [0x80 ... 0xFF] = TRAIT_UTF8,
+};
+
+#define HAS_TRAIT(C, TRAIT) ((CHAR_TRAITS[(uint8_t)(C)] & (TRAIT)) != 0)
+
+// Bulk scanning
+//
+// The helpers below operate on raw pointers between `p` and `end` (the NUL
+// terminator) and never read past `end`. With SSE2 they classify 16 bytes per
+// step; the scalar loops handle the tail and non-x86 targets.
+
+// Skip a run of whitespace.
+static const char *skip_spaces(const char *p, const char *end) {
+#if defined(__SSE2__)
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i control_span = _mm_set1_epi8('\r' - '\t');
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    // '\t', '\n', '\v', '\f' and '\r' are contiguous: an unsigned range check.
+    __m128i relative = _mm_sub_epi8(chunk, tab);
+    __m128i is_control =
+        _mm_cmpeq_epi8(_mm_min_epu8(relative, control_span), relative);
+    __m128i is_space = _mm_or_si128(_mm_cmpeq_epi8(chunk, space), is_control);
+
+    uint32_t non_space = ~(uint32_t)_mm_movemask_epi8(is_space) & 0xFFFF;
+    if (non_space)
+      return p + __builtin_ctz(non_space);
+    p += 16;
+  }
+#endif
+  while (p < end && HAS_TRAIT(*p, TRAIT_SPACE))
+    p++;
+  return p;
+}
+
+// Find the first occurrence of `byte`, or `end` if there is none.
+static const char *find_byte(const char *p, const char *end, char byte) {
+#if defined(__SSE2__)
+  const __m128i needle = _mm_set1_epi8(byte);
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    uint32_t hits = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+    if (hits)
+      return p + __builtin_ctz(hits);
+    p += 16;
+  }
+#endif
+  while (p < end && *p != byte)
+    p++;
+  return p;
+}
+
+// Find the first occurrence of either byte, or `end` if there is none.
+static const char *find_either(const char *p, const char *end, char a,
+                               char b) {
+#if defined(__SSE2__)
+  const __m128i first = _mm_set1_epi8(a);
+  const __m128i second = _mm_set1_epi8(b);
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    __m128i found = _mm_or_si128(_mm_cmpeq_epi8(chunk, first),
+                                 _mm_cmpeq_epi8(chunk, second));
+    uint32_t hits = (uint32_t)_mm_movemask_epi8(found);
+    if (hits)
+      return p + __builtin_ctz(hits);
+    p += 16;
+  }
+#endif
+  while (p < end && *p != a && *p != b)
+    p++;
+  return p;
+}
+
+// Find the first `"` or `\\` of a string literal. `ascii` is cleared if a
+// byte before it is outside ASCII, so ASCII contents need no second pass.
+static const char *find_string_stop(const char *p, const char *end,
+                                    bool *ascii) {
+  uint32_t high = 0;
+#if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    __m128i found = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                                 _mm_cmpeq_epi8(chunk, backslash));
+    uint32_t hits = (uint32_t)_mm_movemask_epi8(found);
+    uint32_t bytes = (uint32_t)_mm_movemask_epi8(chunk);
+    if (hits) {
+      high |= bytes & ((hits & -hits) - 1);
+      *ascii &= high == 0;
+      return p + __builtin_ctz(hits);
+    }
+    high |= bytes;
+    p += 16;
+  }
+#endif
+  while (p < end && *p != '"' && *p != '\\')
+    high |= (uint8_t)*p++ & 0x80;
+  *ascii &= high == 0;
+  return p;
+}
+
+// UTF-8 validation
+//
+// Runs of 16 ASCII bytes are skipped with a single test. With SSSE3 the rest
+// is checked with the lookup algorithm of Keiser and Lemire ("Validating
+// UTF-8 In Less Than One Instruction Per Byte"): three table lookups on the
+// nibbles of each byte and its predecessor flag every malformed two byte
+// pattern, and a check of the bytes two and three back catches missing
+// continuations. It only says whether the input is valid; the scalar loop
+// finds where it isn't. The SSSE3 path is used when the CPU has it.
+
+// First byte of the first malformed sequence in [p, end), scalar.
+static const char *utf8_invalid_at(const char *p, const char *end) {
+  while (p < end) {
+#if defined(__SSE2__)
+    while (end - p >= 16 &&
+           _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p)) == 0)
+      p += 16;
+    if (p == end)
+      break;
+#endif
+    uint8_t c = (uint8_t)*p;
+    if (c < 0x80) {
+      p++;
+      continue;
+    }
+
+    // Continuations and the range of the first one, which excludes overlong
+    // forms, surrogates and code points past U+10FFFF.
+    ptrdiff_t continuations;
+    uint8_t low = 0x80, high = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) {
+      continuations = 1;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+      continuations = 2;
+      low = c == 0xE0 ? 0xA0 : low;
+      high = c == 0xED ? 0x9F : high;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+      continuations = 3;
+      low = c == 0xF0 ? 0x90 : low;
+      high = c == 0xF4 ? 0x8F : high;
+    } else {
+      return p;
+    }
+    if (end - p <= continuations || (uint8_t)p[1] < low ||
+        (uint8_t)p[1] > high)
+      return p;
+    for (ptrdiff_t i = 2; i <= continuations; i++)
+      if (((uint8_t)p[i] & 0xC0) != 0x80)
+        return p;
+    p += continuations + 1;
+  }
+  return NULL;
+}
+
+#if defined(LEXER_SSSE3)
+enum {
+  UTF8_TOO_SHORT = 1 << 0,  // lead byte followed by a lead byte or ASCII
+  UTF8_TOO_LONG = 1 << 1,   // ASCII followed by a continuation
+  UTF8_OVERLONG_3 = 1 << 2, // E0 80..9F
+  UTF8_TOO_LARGE = 1 << 3,  // F4 90..BF, F5..FF
+  UTF8_SURROGATE = 1 << 4,  // ED A0..BF
+  UTF8_OVERLONG_2 = 1 << 5, // C0..C1
+  UTF8_TOO_LARGE_1000 = 1 << 6,
+  UTF8_OVERLONG_4 = 1 << 6, // F0 80..8F
+  UTF8_TWO_CONTS = 1 << 7,  // continuation after a continuation
+  UTF8_CARRY = UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS,
+};
+
+// Errors possible given the high nibble of the previous byte.
+#define UTF8_BYTE_1_HIGH                                                       \
+  _mm_setr_epi8(UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,    \
+                UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,    \
+                UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,                \
+                UTF8_TWO_CONTS, UTF8_TOO_SHORT | UTF8_OVERLONG_2,              \
+                UTF8_TOO_SHORT,                                                \
+                UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,             \
+                UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 |        \
+                    UTF8_OVERLONG_4)
+// ... its low nibble.
+#define UTF8_BYTE_1_LOW                                                        \
+  _mm_setr_epi8(                                                               \
+      UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,        \
+      UTF8_CARRY | UTF8_OVERLONG_2, UTF8_CARRY, UTF8_CARRY,                    \
+      UTF8_CARRY | UTF8_TOO_LARGE,                                             \
+      UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,                       \
+      UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,                       \
+      UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,                       \
+      UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,                       \
+      UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,                       \
+      UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,                       \
+      UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,                       \
+      UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,                       \
+      UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,      \
+      UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,                       \
+      UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000)
+// ... and the high nibble of the byte itself.
+#define UTF8_BYTE_2_HIGH                                                       \
+  _mm_setr_epi8(                                                               \
+      UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,          \
+      UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,          \
+      UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |     \
+          UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,                               \
+      UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |     \
+          UTF8_TOO_LARGE,                                                      \
+      UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |      \
+          UTF8_TOO_LARGE,                                                      \
+      UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |      \
+          UTF8_TOO_LARGE,                                                      \
+      UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT)
+
+// Error bits of `input`, whose preceding 16 bytes are `previous`.
+SSSE3_TARGET static __m128i utf8_block_errors(__m128i input,
+                                              __m128i previous) {
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+  __m128i prev1 = _mm_alignr_epi8(input, previous, 15);
+  __m128i byte_1_high = _mm_shuffle_epi8(
+      UTF8_BYTE_1_HIGH, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+  __m128i byte_1_low =
+      _mm_shuffle_epi8(UTF8_BYTE_1_LOW, _mm_and_si128(prev1, nibble));
+  __m128i byte_2_high = _mm_shuffle_epi8(
+      UTF8_BYTE_2_HIGH, _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+  __m128i special =
+      _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+  // Third and fourth bytes of a sequence must be continuations, which the
+  // lookups leave flagged as TWO_CONTS: the two cancel out.
+  __m128i prev2 = _mm_alignr_epi8(input, previous, 14);
+  __m128i prev3 = _mm_alignr_epi8(input, previous, 13);
+  __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80)));
+  __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80)));
+  __m128i must_continue = _mm_and_si128(_mm_or_si128(third, fourth),
+                                        _mm_set1_epi8((char)0x80));
+  return _mm_xor_si128(must_continue, special);
+}
+
+SSSE3_TARGET static bool utf8_valid_simd(const char *p, const char *end) {
+  __m128i previous = _mm_setzero_si128();
+  __m128i errors = _mm_setzero_si128();
+  bool more = true;
+  while (more) {
+    __m128i input;
+    if (end - p >= 16) {
+      input = _mm_loadu_si128((const __m128i *)p);
+      p += 16;
+    } else {
+      // The tail, padded with ASCII; an all ASCII block after the last one
+      // catches sequences cut short by the end of the input.
+      char tail[16] = {0};
+      memcpy(tail, p, end - p);
+      input = _mm_loadu_si128((const __m128i *)tail);
+      more = p < end;
+      p = end;
+    }
+    if (_mm_movemask_epi8(input) != 0 ||
+        _mm_movemask_epi8(previous) != 0)
+      errors = _mm_or_si128(errors, utf8_block_errors(input, previous));
+    previous = input;
+  }
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(errors, _mm_setzero_si128())) ==
+         0xFFFF;
+}
+#endif
+
+// First byte of the first malformed sequence in [p, end), or NULL when it is
+// all valid UTF-8.
+static const char *utf8_invalid(const char *p, const char *end) {
+#if defined(LEXER_SSSE3)
+  if (__builtin_cpu_supports("ssse3") && utf8_valid_simd(p, end))
+    return NULL;
+#endif
+  return utf8_invalid_at(p, end);
+}
+
+// Count the newlines in [p, end).
+static size_t count_newlines(const char *p, const char *end) {
+  size_t newlines = 0;
+#if defined(__SSE2__)
+  const __m128i newline = _mm_set1_epi8('\n');
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    newlines += (size_t)__builtin_popcount(
+        (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
+    p += 16;
+  }
+#endif
+  while (p < end)
+    newlines += HAS_TRAIT(*p++, TRAIT_NEWLINE);
+  return newlines;
+}
+
+// Offsets of the first byte of every line, found 16 bytes at a time.
+static uint32_t *index_lines(const char *source, size_t length) {
+  uint32_t *line_starts = NULL;
+  arrput(line_starts, 0);
+
+  const char *p = source;
+  const char *end = source + length;
+#if defined(__SSE2__)
+  const __m128i newline = _mm_set1_epi8('\n');
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    uint32_t lines = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+    for (; lines; lines &= lines - 1)
+      arrput(line_starts, (uint32_t)(p - source) + __builtin_ctz(lines) + 1);
+    p += 16;
+  }
+#endif
+  for (; p < end; p++) {
+    if (*p == '\n')
+      arrput(line_starts, (uint32_t)(p - source) + 1);
+  }
+  return line_starts;
+}
+
+// Index of the last line starting at or before `offset`.
+static size_t line_of(const uint32_t *line_starts, size_t offset) {
+  size_t low = 0, high = arrlenu(line_starts);
+  while (high - low > 1) {
+    size_t mid = low + (high - low) / 2;
+    if (line_starts[mid] <= offset)
+      low = mid;
+    else
+      high = mid;
+  }
+  return low;
 }
 
-static char peekn(Lexer *lexer, uint32_t n) {
-  if (lexer->finished)
-    return '\0';
-  debug("Peeked n: %d", n);
-  return *(lexer->current + n - 1);
+// Zero based line and column of `at`, which must lie in the current source.
+// Positions are only worked out on demand, for diagnostics.
+void lexer_position(const Lexer *lexer, const char *at, size_t *line,
+                    size_t *column) {
+  ASSERT(at >= lexer->source && at <= lexer->source + lexer->source_len + 1,
+         "Position outside of the lexer source");
+  size_t offset = at - lexer->source;
+  if (lexer->line_starts != NULL) {
+    *line = line_of(lexer->line_starts, offset);
+    *column = offset - lexer->line_starts[*line];
+    return;
+  }
+
+  // Streaming: count from the start of the window.
+  *line = lexer->window_line + count_newlines(lexer->source, at);
+  const char *line_start = at;
+  while (line_start > lexer->source && line_start[-1] != '\n')
+    line_start--;
+  *column = line_start > lexer->source
+                ? (size_t)(at - line_start)
+                : lexer->window_column + (size_t)(at - lexer->source);
 }
 
 // Consume a whole comment
 static bool match_comment(Lexer *lexer) {
   if (match(lexer, '/')) {
     debug("Matched comment");
-    while ((peek(lexer) != '\n') && !lexer->finished) {
+    const char *end = lexer->source + lexer->source_len;
+    lexer->current = find_byte(lexer->current, end, '\n');
+
+    // A comment on the last line runs into the terminator which, as with
+    // `advance`, finishes the lexer.
+    if (lexer->current == end)
       advance(lexer);
-    }
 
     return true;
   }
@@ -201,24 +790,40 @@ static bool match_comment(Lexer *lexer) {
 static Token parse_identifier(Lexer *lexer) {
   // NOTE: we should have consumed the first digit
   const char *start = lexer->current - 1;
-  size_t length = 1;
 
-  ASSERT(isalpha(*start) || *start == '_',
+  ASSERT(HAS_TRAIT(*start, TRAIT_IDENT_START | TRAIT_UTF8),
          "Starting character for identifier found to be non-alpha");
 
-  char c = peek(lexer);
-  while ((isalnum(c) || c == '_') && !lexer->finished) {
-    length++;
-    advance(lexer);
-    c = peek(lexer);
+  // The NUL terminator has no traits, so this stops inside the source.
+  const char *p = lexer->current;
+  while (HAS_TRAIT(*p, TRAIT_IDENT))
+    p++;
+  if (HAS_TRAIT(*p, TRAIT_UTF8) || HAS_TRAIT(*start, TRAIT_UTF8)) {
+    while (HAS_TRAIT(*p, TRAIT_IDENT | TRAIT_UTF8))
+      p++;
+    // In a partial window the rest of the name may not be read yet.
+    const char *end = lexer->source + lexer->source_len;
+    const char *invalid = utf8_invalid(start, p);
+    if (invalid != NULL && !(p == end && lexer->partial)) {
+      lexer->current = invalid;
+      lex_error_with(lexer, "Invalid UTF-8 in identifier.");
+      lexer->current = p;
+      lexer->had_error = true;
+      return token_at(TOKEN_ERROR, start, (Value){.type = TYPE_NULL});
+    }
   }
+  lexer->current = p;
+  size_t length = p - start;
 
   TokenType type = identifier_type(start, length);
   Value value = {0};
+  SymbolId symbol = SYMBOL_NONE;
   switch (type) {
   case TOKEN_IDENTIFIER:
     value = (Value){.type = TYPE_IDENTIFIER,
                     .as.identifier_value = {.start = start, .length = length}};
+    if (lexer->symbols != NULL)
+      symbol = intern_symbol(lexer->symbols, start, length);
     break;
   case TOKEN_TRUE:
     value = (Value){.type = TYPE_BOOL, .as.bool_value = true};
@@ -230,182 +835,1312 @@ static Token parse_identifier(Lexer *lexer) {
     break;
   }
 
-  return token_at(lexer, type, start, value);
+  Token token = token_at(type, start, value);
+  token.symbol = symbol;
+  return token;
+}
+
+// String literals
+//
+// The contents of a literal without escapes are used in place. Only literals
+// with a backslash in them are decoded, into the lexer's `strings` arena.
+
+// Byte each escape stands for, 0 for invalid escapes.
+static const char ESCAPES[256] = {
+    ['"'] = '"', ['\\'] = '\\', ['n'] = '\n', ['r'] = '\r', ['t'] = '\t',
+};
+
+const char *string_literal_end(const char *start, const char *end) {
+  const char *p = find_either(start, end, '"', '\\');
+  // An escape may be a quote, so skip whatever follows a backslash.
+  while (p < end && *p == '\\')
+    p = p + 2 < end ? find_either(p + 2, end, '"', '\\') : end;
+  return p;
+}
+
+const char *decode_escapes(const char *start, const char *end, char *out,
+                           size_t *length) {
+  char *q = out;
+  const char *p = start;
+  for (;;) {
+    const char *slash = find_byte(p, end, '\\');
+    memcpy(q, p, slash - p);
+    q += slash - p;
+    if (slash + 1 >= end)
+      break;
+    char c = ESCAPES[(uint8_t)slash[1]];
+    if (c == 0)
+      return slash;
+    *q++ = c;
+    p = slash + 2;
+  }
+  *length = q - out;
+  return NULL;
 }
 
 // Parse a string token
 static Token parse_string(Lexer *lexer) {
   const char *start = lexer->current;
-  size_t length = 0;
+  const char *end = lexer->source + lexer->source_len;
 
   debug("Parsing string");
-  debug_block({ fprintf(stderr, "STRING \""); });
-  while (peek(lexer) != '"' && !lexer->finished) {
+  bool ascii = true;
+  const char *quote = find_string_stop(start, end, &ascii);
+  bool escaped = quote < end && *quote == '\\';
+  if (escaped)
+    quote = string_literal_end(quote, end);
+  size_t length = quote - start;
+  debug("STRING \"%.*s\" (length: %zu)", (int)length, start, length);
 
-#if DEBUG
-    char c = advance(lexer);
-    debug_block({ fprintf(stderr, "%c", c); });
-#else
-    advance(lexer);
-#endif
+  Value value = {.type = TYPE_STRING,
+                 .as.string_value = {.start = start, .length = length}};
+  Token token = token_at(TOKEN_STRING, start, value);
+  lexer->current = quote;
 
-    length++;
+  // In a partial window the closing quote may simply not be read yet.
+  const char *invalid = NULL;
+  if (quote == end && !lexer->partial) {
+    lex_error_with(lexer, "Unterminated string.");
+    lexer->had_error = true;
+    token.type = TOKEN_ERROR;
+  } else if (quote < end && (!ascii || escaped) &&
+             (invalid = utf8_invalid(start, quote)) != NULL) {
+    lexer->current = invalid;
+    lex_error_with(lexer, "Invalid UTF-8 in string.");
+    lexer->current = quote;
+    lexer->had_error = true;
+    token.type = TOKEN_ERROR;
+  } else if (escaped && quote < end) {
+    char *decoded = arena_alloc(lexer->strings, length, 1);
+    const char *invalid = decode_escapes(start, quote, decoded, &length);
+    if (invalid != NULL) {
+      lexer->current = invalid;
+      lex_error_with(lexer, "Invalid escape sequence.");
+      lexer->current = quote;
+      lexer->had_error = true;
+      token.type = TOKEN_ERROR;
+    }
+    token.value.as.string_value =
+        (String){.start = decoded, .length = length};
   }
-  debug_block({ fprintf(stderr, "\" (length: %zu)\n", length); });
 
-  // At the end of parsing we will be on the `"` and so we
-  // consume that one more time.
+  // Consume the closing `"` (or the terminator of an unterminated string).
   advance(lexer);
 
-  Value value = {.type = TYPE_STRING,
-                 .as.string_value = {.start = start, .length = length}};
-  return token_at(lexer, TOKEN_STRING, start, value);
+  return token;
+}
+
+// Number conversion
+//
+// Literals are `digits ( "." digits )?`. Up to 19 significant digits are
+// accumulated exactly into a 64 bit mantissa with a decimal exponent, which
+// is then converted with Clinger's exact fast path or, failing that, the
+// Eisel-Lemire algorithm. Anything those can't decide goes through `strtod`.
+
+#define NUMBER_MAX_DIGITS 19
+#define NUMBER_MIN_EXP10 (-64)
+
+static const double POWERS_OF_TEN[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// The 128 most significant bits of 10^q for NUMBER_MIN_EXP10 <= q < 0,
+// high word first, rounded up.
+static const uint64_t POWERS_OF_FIVE_128[][2] = {
+    {0xa87fea27a539e9a5ULL, 0x3f2398d747b36224ULL}, // 1e-64
+    {0xd29fe4b18e88640eULL, 0x8eec7f0d19a03aadULL}, // 1e-63
+    {0x83a3eeeef9153e89ULL, 0x1953cf68300424acULL}, // 1e-62
+    {0xa48ceaaab75a8e2bULL, 0x5fa8c3423c052dd7ULL}, // 1e-61
+    {0xcdb02555653131b6ULL, 0x3792f412cb06794dULL}, // 1e-60
+    {0x808e17555f3ebf11ULL, 0xe2bbd88bbee40bd0ULL}, // 1e-59
+    {0xa0b19d2ab70e6ed6ULL, 0x5b6aceaeae9d0ec4ULL}, // 1e-58
+    {0xc8de047564d20a8bULL, 0xf245825a5a445275ULL}, // 1e-57
+    {0xfb158592be068d2eULL, 0xeed6e2f0f0d56712ULL}, // 1e-56
+    {0x9ced737bb6c4183dULL, 0x55464dd69685606bULL}, // 1e-55
+    {0xc428d05aa4751e4cULL, 0xaa97e14c3c26b886ULL}, // 1e-54
+    {0xf53304714d9265dfULL, 0xd53dd99f4b3066a8ULL}, // 1e-53
+    {0x993fe2c6d07b7fabULL, 0xe546a8038efe4029ULL}, // 1e-52
+    {0xbf8fdb78849a5f96ULL, 0xde98520472bdd033ULL}, // 1e-51
+    {0xef73d256a5c0f77cULL, 0x963e66858f6d4440ULL}, // 1e-50
+    {0x95a8637627989aadULL, 0xdde7001379a44aa8ULL}, // 1e-49
+    {0xbb127c53b17ec159ULL, 0x5560c018580d5d52ULL}, // 1e-48
+    {0xe9d71b689dde71afULL, 0xaab8f01e6e10b4a6ULL}, // 1e-47
+    {0x9226712162ab070dULL, 0xcab3961304ca70e8ULL}, // 1e-46
+    {0xb6b00d69bb55c8d1ULL, 0x3d607b97c5fd0d22ULL}, // 1e-45
+    {0xe45c10c42a2b3b05ULL, 0x8cb89a7db77c506aULL}, // 1e-44
+    {0x8eb98a7a9a5b04e3ULL, 0x77f3608e92adb242ULL}, // 1e-43
+    {0xb267ed1940f1c61cULL, 0x55f038b237591ed3ULL}, // 1e-42
+    {0xdf01e85f912e37a3ULL, 0x6b6c46dec52f6688ULL}, // 1e-41
+    {0x8b61313bbabce2c6ULL, 0x2323ac4b3b3da015ULL}, // 1e-40
+    {0xae397d8aa96c1b77ULL, 0xabec975e0a0d081aULL}, // 1e-39
+    {0xd9c7dced53c72255ULL, 0x96e7bd358c904a21ULL}, // 1e-38
+    {0x881cea14545c7575ULL, 0x7e50d64177da2e54ULL}, // 1e-37
+    {0xaa242499697392d2ULL, 0xdde50bd1d5d0b9e9ULL}, // 1e-36
+    {0xd4ad2dbfc3d07787ULL, 0x955e4ec64b44e864ULL}, // 1e-35
+    {0x84ec3c97da624ab4ULL, 0xbd5af13bef0b113eULL}, // 1e-34
+    {0xa6274bbdd0fadd61ULL, 0xecb1ad8aeacdd58eULL}, // 1e-33
+    {0xcfb11ead453994baULL, 0x67de18eda5814af2ULL}, // 1e-32
+    {0x81ceb32c4b43fcf4ULL, 0x80eacf948770ced7ULL}, // 1e-31
+    {0xa2425ff75e14fc31ULL, 0xa1258379a94d028dULL}, // 1e-30
+    {0xcad2f7f5359a3b3eULL, 0x096ee45813a04330ULL}, // 1e-29
+    {0xfd87b5f28300ca0dULL, 0x8bca9d6e188853fcULL}, // 1e-28
+    {0x9e74d1b791e07e48ULL, 0x775ea264cf55347eULL}, // 1e-27
+    {0xc612062576589ddaULL, 0x95364afe032a819eULL}, // 1e-26
+    {0xf79687aed3eec551ULL, 0x3a83ddbd83f52205ULL}, // 1e-25
+    {0x9abe14cd44753b52ULL, 0xc4926a9672793543ULL}, // 1e-24
+    {0xc16d9a0095928a27ULL, 0x75b7053c0f178294ULL}, // 1e-23
+    {0xf1c90080baf72cb1ULL, 0x5324c68b12dd6339ULL}, // 1e-22
+    {0x971da05074da7beeULL, 0xd3f6fc16ebca5e04ULL}, // 1e-21
+    {0xbce5086492111aeaULL, 0x88f4bb1ca6bcf585ULL}, // 1e-20
+    {0xec1e4a7db69561a5ULL, 0x2b31e9e3d06c32e6ULL}, // 1e-19
+    {0x9392ee8e921d5d07ULL, 0x3aff322e62439fd0ULL}, // 1e-18
+    {0xb877aa3236a4b449ULL, 0x09befeb9fad487c3ULL}, // 1e-17
+    {0xe69594bec44de15bULL, 0x4c2ebe687989a9b4ULL}, // 1e-16
+    {0x901d7cf73ab0acd9ULL, 0x0f9d37014bf60a11ULL}, // 1e-15
+    {0xb424dc35095cd80fULL, 0x538484c19ef38c95ULL}, // 1e-14
+    {0xe12e13424bb40e13ULL, 0x2865a5f206b06fbaULL}, // 1e-13
+    {0x8cbccc096f5088cbULL, 0xf93f87b7442e45d4ULL}, // 1e-12
+    {0xafebff0bcb24aafeULL, 0xf78f69a51539d749ULL}, // 1e-11
+    {0xdbe6fecebdedd5beULL, 0xb573440e5a884d1cULL}, // 1e-10
+    {0x89705f4136b4a597ULL, 0x31680a88f8953031ULL}, // 1e-9
+    {0xabcc77118461cefcULL, 0xfdc20d2b36ba7c3eULL}, // 1e-8
+    {0xd6bf94d5e57a42bcULL, 0x3d32907604691b4dULL}, // 1e-7
+    {0x8637bd05af6c69b5ULL, 0xa63f9a49c2c1b110ULL}, // 1e-6
+    {0xa7c5ac471b478423ULL, 0x0fcf80dc33721d54ULL}, // 1e-5
+    {0xd1b71758e219652bULL, 0xd3c36113404ea4a9ULL}, // 1e-4
+    {0x83126e978d4fdf3bULL, 0x645a1cac083126eaULL}, // 1e-3
+    {0xa3d70a3d70a3d70aULL, 0x3d70a3d70a3d70a4ULL}, // 1e-2
+    {0xccccccccccccccccULL, 0xcccccccccccccccdULL}, // 1e-1
+};
+
+// Eisel-Lemire: the correctly rounded double nearest to mantissa * 10^exp10,
+// or false when the result can't be decided without arbitrary precision.
+static bool eisel_lemire(uint64_t mantissa, int exp10, double *out) {
+  ASSERT(mantissa != 0 && exp10 >= NUMBER_MIN_EXP10 && exp10 < 0,
+         "Eisel-Lemire called outside its table");
+  const uint64_t *power = POWERS_OF_FIVE_128[exp10 - NUMBER_MIN_EXP10];
+
+  int leading_zeros = __builtin_clzll(mantissa);
+  mantissa <<= leading_zeros;
+  uint64_t exp2 =
+      (uint64_t)(((217706 * exp10) >> 16) + 64 + 1023) - (uint64_t)leading_zeros;
+
+  unsigned __int128 product = (unsigned __int128)mantissa * power[0];
+  uint64_t high = (uint64_t)(product >> 64);
+  uint64_t low = (uint64_t)product;
+
+  // The truncated power may be too small to decide the rounding: widen it.
+  if ((high & 0x1FF) == 0x1FF && low + mantissa < mantissa) {
+    unsigned __int128 wide = (unsigned __int128)mantissa * power[1];
+    uint64_t wide_high = (uint64_t)(wide >> 64);
+    uint64_t wide_low = (uint64_t)wide;
+    uint64_t merged_low = low + wide_high;
+    if (merged_low < low)
+      high++;
+    if ((high & 0x1FF) == 0x1FF && merged_low + 1 == 0 &&
+        wide_low + mantissa < mantissa)
+      return false;
+    low = merged_low;
+  }
+
+  uint64_t msb = high >> 63;
+  uint64_t bits = high >> (msb + 9);
+  exp2 -= 1 ^ msb;
+
+  // Exactly halfway between two doubles.
+  if (low == 0 && (high & 0x1FF) == 0 && (bits & 3) == 1)
+    return false;
+
+  bits += bits & 1;
+  bits >>= 1;
+  if (bits >> 53) {
+    bits >>= 1;
+    exp2++;
+  }
+  // Subnormal or infinite.
+  if (exp2 - 1 >= 0x7FF - 1)
+    return false;
+
+  uint64_t raw = exp2 << 52 | (bits & 0x000FFFFFFFFFFFFFULL);
+  memcpy(out, &raw, sizeof(*out));
+  return true;
+}
+
+// Fallback for literals the fast paths can't convert. The slice isn't NUL
+// terminated, so it is copied; long literals get a heap buffer.
+static double convert_number_slow(const char *start, size_t length) {
+  char buf[64];
+  char *copy = length < sizeof(buf) ? buf : malloc(length + 1);
+  if (copy == NULL) {
+    fprintf(stderr, ERROR ": memory allocation for number literal failed\n");
+    exit(LEXER_EXIT_FAILURE);
+  }
+  memcpy(copy, start, length);
+  copy[length] = '\0';
+  double value = strtod(copy, NULL);
+  if (copy != buf)
+    free(copy);
+  return value;
+}
+
+static double convert_number(uint64_t mantissa, int exp10, bool truncated,
+                             const char *start, size_t length) {
+  if (!truncated) {
+    if (mantissa == 0)
+      return 0.0;
+    if (exp10 == 0)
+      return (double)mantissa; // the conversion itself rounds correctly
+    // Clinger: both operands are exact, so the single operation rounds
+    // correctly.
+    if (mantissa <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22)
+      return exp10 < 0 ? (double)mantissa / POWERS_OF_TEN[-exp10]
+                       : (double)mantissa * POWERS_OF_TEN[exp10];
+    double value;
+    if (exp10 < 0 && exp10 >= NUMBER_MIN_EXP10 &&
+        eisel_lemire(mantissa, exp10, &value))
+      return value;
+  }
+  debug("Slow number conversion");
+  return convert_number_slow(start, length);
 }
 
 static Token parse_number(Lexer *lexer) {
   // NOTE: we should have consumed the first digit
   const char *start = lexer->current - 1;
-  size_t length = 1;
+  const char *p = start;
 
-  ASSERT(isdigit(*start),
+  ASSERT(HAS_TRAIT(*start, TRAIT_DIGIT),
          "Starting character found to be not digit when parsing number");
 
-  bool encountered_dot = false;
-  char c = peek(lexer);
-  while ((isdigit(c) || (c == '.' && !encountered_dot)) && !lexer->finished) {
-    if (c == '.' && !encountered_dot) {
-      // NOTE: make sure that we have a digit after the dot
-      if (!isdigit(peekn(lexer, 2))) {
-        break;
+  uint64_t mantissa = 0;
+  int digits = 0; // significant digits in `mantissa`
+  int exp10 = 0;
+  bool truncated = false; // non-zero digits didn't fit in `mantissa`
+
+  for (; HAS_TRAIT(*p, TRAIT_DIGIT); p++) {
+    if (digits < NUMBER_MAX_DIGITS) {
+      mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+      digits += mantissa != 0;
+    } else {
+      exp10++;
+      truncated |= *p != '0';
+    }
+  }
+  // NOTE: make sure that we have a digit after the dot
+  if (*p == '.' && HAS_TRAIT(p[1], TRAIT_DIGIT)) {
+    for (p++; HAS_TRAIT(*p, TRAIT_DIGIT); p++) {
+      if (digits < NUMBER_MAX_DIGITS) {
+        mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+        digits += mantissa != 0;
+        exp10--;
+      } else {
+        truncated |= *p != '0';
       }
-      encountered_dot = true;
     }
-    length++;
-    advance(lexer);
-    c = peek(lexer);
   }
-  // NOTE: we do this to do the conversion with `strtod`
-  char buf[MAX_NUMBER_DIGITS + 1]; // enough space for number + null terminator
-  memcpy(buf, start, length);
-  buf[length] = '\0';
 
-  Value value = {.type = TYPE_NUMBER, .as.number_value = strtod(buf, NULL)};
+  size_t length = p - start;
+  lexer->current = p;
+
+  Value value = {.type = TYPE_NUMBER,
+                 .as.number_value =
+                     convert_number(mantissa, exp10, truncated, start, length)};
 
-  return token_at(lexer, TOKEN_NUMBER, start, value);
+  return token_at(TOKEN_NUMBER, start, value);
 }
 
 static void consume_whitespace(Lexer *lexer) {
-  // Indicates if we consumed any whitespace
   ASSERT(lexer->current != NULL,
          "Lexer current is NULL while consuming whitespace");
-  while (isspace(*lexer->current)) {
-    if (*lexer->current == '\n') {
-      debug("Consuming WHITESPACE ('\\n')");
-      lexer->line++;
-      advance(lexer);
-      lexer->line_offset = 0; // RESET the line_offset
-    } else {
-      debug("Consuming WHITESPACE");
-      advance(lexer);
-    }
-  }
+  debug("Consuming WHITESPACE");
+  lexer->current =
+      skip_spaces(lexer->current, lexer->source + lexer->source_len);
 }
 
-Token next_token(Lexer *lexer) {
+// Dispatch tables
+//
+// The first byte of a token selects its class; single-byte tokens and the
+// operators that may be followed by `=` are then resolved by table lookups
+// rather than a branch per character. Unlisted bytes are CLASS_ERROR.
+typedef enum {
+  CLASS_ERROR = 0,
+  CLASS_SINGLE,   // a complete token on its own
+  CLASS_OPERATOR, // becomes a different token when followed by `=`
+  CLASS_SLASH,    // division or the start of a comment
+  CLASS_QUOTE,
+  CLASS_DIGIT,
+  CLASS_ALPHA,
+} CharClass;
+
+static const uint8_t CHAR_CLASS[256] = {
+    ['\0'] = CLASS_SINGLE,
+    ['('] = CLASS_SINGLE,
+    [')'] = CLASS_SINGLE,
+    ['{'] = CLASS_SINGLE,
+    ['}'] = CLASS_SINGLE,
+    [','] = CLASS_SINGLE,
+    ['.'] = CLASS_SINGLE,
+    ['-'] = CLASS_SINGLE,
+    ['+'] = CLASS_SINGLE,
+    [';'] = CLASS_SINGLE,
+    ['*'] = CLASS_SINGLE,
+    ['!'] = CLASS_OPERATOR,
+    ['='] = CLASS_OPERATOR,
+    ['>'] = CLASS_OPERATOR,
+    ['<'] = CLASS_OPERATOR,
+    ['/'] = CLASS_SLASH,
+    ['"'] = CLASS_QUOTE,
+    ['0' ... '9'] = CLASS_DIGIT,
+    ['a' ... 'z'] = CLASS_ALPHA,
+    ['A' ... 'Z'] = CLASS_ALPHA,
+    ['_'] = CLASS_ALPHA,
+    [0x80 ... 0xFF] = CLASS_ALPHA, // checked to be UTF-8 by parse_identifier
+};
+
+// Token produced by a byte of class CLASS_SINGLE or CLASS_OPERATOR on its own.
+static const uint8_t SINGLE_TOKEN[256] = {
+    ['\0'] = TOKEN_EOF,
+    ['('] = TOKEN_LEFT_PAREN,
+    [')'] = TOKEN_RIGHT_PAREN,
+    ['{'] = TOKEN_LEFT_BRACE,
+    ['}'] = TOKEN_RIGHT_BRACE,
+    [','] = TOKEN_COMMA,
+    ['.'] = TOKEN_DOT,
+    ['-'] = TOKEN_MINUS,
+    ['+'] = TOKEN_PLUS,
+    [';'] = TOKEN_SEMICOLON,
+    ['*'] = TOKEN_STAR,
+    ['!'] = TOKEN_BANG,
+    ['='] = TOKEN_EQUAL,
+    ['>'] = TOKEN_GREATER,
+    ['<'] = TOKEN_LESS,
+    ['/'] = TOKEN_SLASH,
+};
+
+// Transition of a CLASS_OPERATOR byte on a following `=`.
+static const uint8_t EQUAL_TRANSITION[256] = {
+    ['!'] = TOKEN_BANG_EQUAL,
+    ['='] = TOKEN_EQUAL_EQUAL,
+    ['>'] = TOKEN_GREATER_EQUAL,
+    ['<'] = TOKEN_LESS_EQUAL,
+};
+
+static Token lex_token(Lexer *lexer) {
   ASSERT(!lexer->finished, "Tried to fetch next token from a finished lexer");
 
   consume_whitespace(lexer);
 
-  Token token;
   char c = advance(lexer);
-  switch (c) {
-  case '(':
-    token = newtoken(lexer, TOKEN_LEFT_PAREN);
-    break;
-  case ')':
-    token = newtoken(lexer, TOKEN_RIGHT_PAREN);
-    break;
-  case '{':
-    token = newtoken(lexer, TOKEN_LEFT_BRACE);
-    break;
-  case '}':
-    token = newtoken(lexer, TOKEN_RIGHT_BRACE);
-    break;
-  case ',':
-    token = newtoken(lexer, TOKEN_COMMA);
-    break;
-  case '.':
-    token = newtoken(lexer, TOKEN_DOT);
-    break;
-  case '-':
-    token = newtoken(lexer, TOKEN_MINUS);
-    break;
-  case '+':
-    token = newtoken(lexer, TOKEN_PLUS);
-    break;
-  case ';':
-    token = newtoken(lexer, TOKEN_SEMICOLON);
-    break;
-  case '*':
-    token = newtoken(lexer, TOKEN_STAR);
-    break;
-  case '/':
-    token = match_comment(lexer) ? newtoken(lexer, TOKEN_COMMENT)
-                                 : newtoken(lexer, TOKEN_SLASH);
-    break;
-  case '!':
-    token = match(lexer, '=') ? newtoken(lexer, TOKEN_BANG_EQUAL)
-                              : newtoken(lexer, TOKEN_BANG);
-    break;
-  case '=':
-    token = match(lexer, '=') ? newtoken(lexer, TOKEN_EQUAL_EQUAL)
-                              : newtoken(lexer, TOKEN_EQUAL);
-    break;
-  case '>':
-    token = match(lexer, '=') ? newtoken(lexer, TOKEN_GREATER_EQUAL)
-                              : newtoken(lexer, TOKEN_GREATER);
-    break;
-  case '<':
-    token = match(lexer, '=') ? newtoken(lexer, TOKEN_LESS_EQUAL)
-                              : newtoken(lexer, TOKEN_LESS);
-    break;
-  case '"':
-    token = parse_string(lexer);
+  uint8_t byte = (uint8_t)c;
+  switch ((CharClass)CHAR_CLASS[byte]) {
+  case CLASS_SINGLE:
+    return newtoken(lexer, SINGLE_TOKEN[byte]);
+  case CLASS_OPERATOR:
+    return newtoken(lexer, match(lexer, '=') ? EQUAL_TRANSITION[byte]
+                                             : SINGLE_TOKEN[byte]);
+  case CLASS_SLASH:
+    return newtoken(lexer,
+                    match_comment(lexer) ? TOKEN_COMMENT : SINGLE_TOKEN[byte]);
+  case CLASS_QUOTE:
+    return parse_string(lexer);
+  case CLASS_DIGIT:
+    return parse_number(lexer);
+  case CLASS_ALPHA:
+    return parse_identifier(lexer);
+  case CLASS_ERROR:
     break;
+  }
 
-  case '\0':
-    token = newtoken(lexer, TOKEN_EOF);
-    break;
+  // NOTE: doesn't change lexer state the current in the case of failure;
+  lex_error_with(lexer, "Unexpected character: %c", c);
+  lexer->had_error = true;
+  return newtoken(lexer, TOKEN_ERROR);
+}
 
-  default:
-    if (isdigit(c)) {
-      token = parse_number(lexer);
-    } else if (isalpha(c) || c == '_') {
-      token = parse_identifier(lexer);
-    } else {
-      // NOTE: doesn't change lexer state the current in the case of failure;
-      lex_error_with(lexer, "Unexpected character: %c", c);
-      lexer->had_error = true;
-      token = newtoken(lexer, TOKEN_ERROR);
+// Streaming
+
+// Move the unconsumed tail of the window to its front and fill the rest from
+// the stream, growing the window when a single token outgrows it.
+static void refill_window(Lexer *lexer) {
+  ASSERT(lexer->stream != NULL, "Refilling a lexer that is not streaming");
+
+  char *window = (char *)lexer->source;
+
+  // Account for the consumed part of the window before dropping it.
+  size_t newlines = count_newlines(window, lexer->current);
+  if (newlines > 0) {
+    const char *line_start = lexer->current;
+    while (line_start[-1] != '\n')
+      line_start--;
+    lexer->window_line += newlines;
+    lexer->window_column = lexer->current - line_start;
+  } else {
+    lexer->window_column += lexer->current - window;
+  }
+  lexer->window_offset += lexer->current - window;
+
+  size_t keep = lexer->source + lexer->source_len - lexer->current;
+  memmove(window, lexer->current, keep);
+
+  if (lexer->window_capacity - 1 - keep < LEXER_STREAM_CHUNK) {
+    lexer->window_capacity = 2 * lexer->window_capacity;
+    window = realloc(window, lexer->window_capacity);
+    if (window == NULL) {
+      fprintf(stderr, ERROR ": memory allocation for file %s failed\n",
+              lexer->source_filename);
+      exit(LEXER_EXIT_FAILURE);
     }
   }
 
-  return token;
+  size_t space = lexer->window_capacity - 1 - keep;
+  size_t read = fread(window + keep, 1, space, lexer->stream);
+  // `fread` only comes up short at the end of the stream or on error.
+  if (read < space)
+    lexer->partial = false;
+  window[keep + read] = '\0';
+  if (lexer->stream_hash != NULL)
+    update_source_hash(lexer->stream_hash, window + keep, read);
+
+  debug("Refilled window: kept %zu, read %zu", keep, read);
+  lexer->source = window;
+  lexer->current = window;
+  lexer->source_len = keep + read;
 }
 
-void scan_tokens(Lexer *lexer) {
-  while ((size_t)(lexer->current - lexer->source) < lexer->source_len) {
+Token next_token(Lexer *lexer) {
+  if (lexer->stream == NULL)
+    return lex_token(lexer);
+
+  // The previous token has expired along with its decoded text.
+  arena_reset(lexer->strings);
+  for (;;) {
+    Lexer saved = *lexer;
+    Token token = lex_token(lexer);
+    // The lexer looks at most one byte past the end of a token. If that
+    // stayed inside the window the token is final; otherwise it may have been
+    // cut short, so rewind and lex it again with more input. An error token
+    // is a single unexpected byte and never needs more input.
+    if (!lexer->partial || token.type == TOKEN_ERROR ||
+        lexer->current + 1 < lexer->source + lexer->source_len)
+      return token;
+
+    *lexer = saved;
+    refill_window(lexer);
+  }
+}
+
+// True once the whole input has been consumed.
+bool lexer_exhausted(const Lexer *lexer) {
+  return lexer->finished ||
+         (!lexer->partial &&
+          (size_t)(lexer->current - lexer->source) >= lexer->source_len);
+}
+
+static void stream_push(TokenStream *stream, const Token *token);
+
+// Collect tokens into `stream`, or `lexer->tokens` when it is NULL, until the
+// next token would start at or after `boundary`, or until the input runs out
+// when `boundary` is NULL.
+static void scan_until(Lexer *lexer, const char *boundary,
+                       TokenStream *stream) {
+  while (!lexer_exhausted(lexer)) {
     ASSERT(lexer->current != NULL,
            "NULL `current` found for the given lexer inside of scan_token");
 
     debug_block({ preview_string(lexer->current); });
 
-    Token token = next_token(lexer);
+    if (boundary != NULL) {
+      consume_whitespace(lexer);
+      if (lexer->current >= boundary)
+        break;
+    }
 
-    if (token.type != TOKEN_COMMENT && token.type != TOKEN_ERROR)
+    Token token = next_token(lexer);
+    if (token.type == TOKEN_COMMENT || token.type == TOKEN_ERROR)
+      continue;
+    if (stream != NULL)
+      stream_push(stream, &token);
+    else
       arrput(lexer->tokens, token);
+  }
+}
+
+// Parallel scanning
+//
+// The source is cut after newlines into one slice per thread. Every slice is
+// lexed speculatively, on the assumption that it doesn't start inside a
+// string literal. Each slice interns its identifiers into a table of its
+// own; merging adds those names to the lexer's table in slice order, so ids
+// still follow source order, and renumbers the slice's tokens.
+//
+// Slices are then merged in order. A slice is accepted when the lexer of the
+// preceding input stopped exactly where the slice's first token starts;
+// otherwise the preceding lexer carries on through the slice serially. Slices
+// that hit an error are re-lexed serially too, so that every diagnostic is
+// reported exactly once and in source order.
+//
+// When the result is a compact stream, slices are lexed into compact streams
+// of their own too, so that the full `Token`s never exist all at once.
+
+typedef struct {
+  Lexer lexer;            // copy of the parent lexer, started at the slice
+  const char *boundary;   // end of the slice, NULL for the last one
+  const char *first;      // where the slice's first token starts
+  bool compact;           // tokens go to `stream`, not `lexer.tokens`
+  TokenStream stream;
+} LexSlice;
+
+// Add a slice's names to `table` in the order the slice interned them, that
+// of their first occurrence. Returns the id in `table` of each slice id.
+static SymbolId *merge_symbols(SymbolTable *table, const SymbolTable *slice) {
+  SymbolId *remap = NULL; // Vec<SymbolId>
+  for (size_t id = 0; id < arrlenu(slice->names); id++)
+    arrput(remap, intern_hashed(table, slice->names[id].start,
+                                slice->names[id].length, slice->hashes[id]));
+  return remap;
+}
+
+static void *scan_slice(void *arg) {
+  LexSlice *slice = arg;
+  consume_whitespace(&slice->lexer);
+  slice->first = slice->lexer.current;
+  scan_until(&slice->lexer, slice->boundary,
+             slice->compact ? &slice->stream : NULL);
+  return NULL;
+}
+
+// Append an accepted slice's stream to `stream`, renumbering its symbols
+// through `remap` and its numbers and strings past those already there.
+static void append_stream(TokenStream *stream, const TokenStream *slice,
+                          const SymbolId *remap) {
+  uint32_t numbers = (uint32_t)arrlenu(stream->numbers);
+  uint32_t strings = (uint32_t)arrlenu(stream->strings);
+  size_t count = stream_length(slice);
+  if (count == 0)
+    return;
+
+  memcpy(arraddnptr(stream->types, count), slice->types, count);
+  memcpy(arraddnptr(stream->offsets, count), slice->offsets,
+         count * sizeof(uint32_t));
+  uint32_t *payloads = arraddnptr(stream->payloads, count);
+  for (size_t i = 0; i < count; i++) {
+    uint32_t payload = slice->payloads[i];
+    switch (slice->types[i]) {
+    case TOKEN_IDENTIFIER:
+      payload = remap[payload];
+      break;
+    case TOKEN_STRING:
+      if (payload & STREAM_STRING_INDEX)
+        payload += strings;
+      break;
+    case TOKEN_NUMBER:
+      payload += numbers;
+      break;
+    default:
+      break;
+    }
+    payloads[i] = payload;
+  }
+  if (arrlenu(slice->numbers) > 0)
+    memcpy(arraddnptr(stream->numbers, arrlenu(slice->numbers)),
+           slice->numbers, arrlenu(slice->numbers) * sizeof(double));
+  if (arrlenu(slice->strings) > 0)
+    memcpy(arraddnptr(stream->strings, arrlenu(slice->strings)),
+           slice->strings, arrlenu(slice->strings) * sizeof(String));
+}
+
+static size_t lexing_threads(const Lexer *lexer) {
+  if (lexer->stream != NULL || lexer->max_threads == 1)
+    return 1;
+  size_t threads = lexer->max_threads;
+  if (threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 1 ? (size_t)cpus : 1;
+  }
+  size_t slices = lexer->source_len / LEXER_PARALLEL_CHUNK;
+  return slices < threads ? (slices > 0 ? slices : 1) : threads;
+}
+
+// Into `stream` if there is one, `lexer->tokens` otherwise.
+static void scan_tokens_parallel(Lexer *lexer, size_t threads,
+                                 TokenStream *stream) {
+  const char *end = lexer->source + lexer->source_len;
+  LexSlice *slices = calloc(threads, sizeof(LexSlice));
+  pthread_t *workers = calloc(threads, sizeof(pthread_t));
+  if (slices == NULL || workers == NULL) {
+    free(slices);
+    free(workers);
+    scan_until(lexer, NULL, stream);
+    return;
+  }
+
+  // Cut after the first newline past each even split point.
+  size_t count = 0;
+  const char *begin = lexer->source;
+  while (begin < end && count < threads) {
+    const char *boundary = NULL;
+    if (count + 1 < threads) {
+      const char *split = lexer->source +
+                          (count + 1) * (lexer->source_len / threads);
+      if (split < begin)
+        split = begin;
+      boundary = find_byte(split, end, '\n') + 1;
+      if (boundary >= end)
+        boundary = NULL;
+    }
+
+    LexSlice *slice = &slices[count++];
+    slice->lexer = *lexer;
+    slice->lexer.current = begin;
+    slice->lexer.tokens = NULL;
+    // Both are merged into the lexer's own, see below.
+    slice->lexer.symbols = calloc(1, sizeof(SymbolTable));
+    slice->lexer.strings = calloc(1, sizeof(Arena));
+    if (slice->lexer.symbols == NULL || slice->lexer.strings == NULL) {
+      fprintf(stderr, ERROR ": memory allocation for file %s failed\n",
+              lexer->source_filename);
+      exit(LEXER_EXIT_FAILURE);
+    }
+    slice->lexer.silent = true;
+    slice->boundary = boundary;
+    slice->compact = stream != NULL;
+    slice->stream = (TokenStream){.source = lexer->source,
+                                  .symbols = slice->lexer.symbols};
+
+    if (boundary == NULL)
+      break;
+    begin = boundary;
+  }
+
+  size_t started = 0;
+  for (; started < count; started++) {
+    if (pthread_create(&workers[started], NULL, scan_slice,
+                       &slices[started]) != 0)
+      break;
+  }
+  // Lex whatever couldn't get a thread on this one.
+  for (size_t i = started; i < count; i++)
+    scan_slice(&slices[i]);
+  for (size_t i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+
+  Lexer serial = *lexer;
+  bool had_error = false;
+  consume_whitespace(&serial);
+  for (size_t i = 0; i < count; i++) {
+    LexSlice *slice = &slices[i];
+    if (serial.current == slice->first && !slice->lexer.had_error) {
+      debug("Accepted lexing slice %zu", i);
+      bool renumber = arrlenu(lexer->symbols->names) > 0;
+      SymbolId *remap = merge_symbols(lexer->symbols, slice->lexer.symbols);
+      Token *tokens = serial.tokens;
+      if (stream != NULL && stream_length(stream) == 0 && !renumber) {
+        // The first slice's stream needs no renumbering and becomes the
+        // result as it is.
+        TokenStream taken = slice->stream;
+        taken.symbols = stream->symbols;
+        free_token_stream(stream);
+        *stream = taken;
+        slice->stream = (TokenStream){0};
+      } else if (stream != NULL) {
+        append_stream(stream, &slice->stream, remap);
+      }
+      for (ptrdiff_t t = 0; t < arrlen(slice->lexer.tokens); t++) {
+        Token token = slice->lexer.tokens[t];
+        if (token.type == TOKEN_IDENTIFIER)
+          token.symbol = remap[token.symbol];
+        arrput(tokens, token);
+      }
+      arrfree(remap);
+      arena_adopt(lexer->strings, slice->lexer.strings);
+      serial = slice->lexer;
+      serial.tokens = tokens;
+      serial.symbols = lexer->symbols;
+      serial.strings = lexer->strings;
+      serial.silent = false;
+    } else {
+      debug("Re-lexing slice %zu", i);
+      scan_until(&serial, slice->boundary, stream);
+    }
+    had_error |= serial.had_error;
+    arrfree(slice->lexer.tokens);
+    free_token_stream(&slice->stream);
+    free_symbol_table(slice->lexer.symbols);
+    free(slice->lexer.symbols);
+    free_arena(slice->lexer.strings);
+    free(slice->lexer.strings);
+  }
+
+  serial.had_error = had_error;
+  *lexer = serial;
+  free(slices);
+  free(workers);
+}
+
+void scan_tokens(Lexer *lexer) {
+  size_t threads = lexing_threads(lexer);
+  if (threads > 1)
+    scan_tokens_parallel(lexer, threads, NULL);
+  else
+    scan_until(lexer, NULL, NULL);
+}
+
+// Incremental re-lexing
+//
+// The lexer carries no state between tokens but its position, so after an
+// edit lexing restarts a couple of tokens ahead of it and stops as soon as a
+// new token begins where an old one behind the edit did: from there on the old
+// tokens are still right.
+//
+// The re-lexer sees the text in front of the gap, with a NUL sentinel in the
+// gap, much as a streaming lexer sees its window: a token that runs into the
+// gap is lexed again once the gap has moved on past a few more old tokens.
+
+// Where `token` begins: punctuators record where they end, strings where
+// their contents start.
+static const char *token_begin(const Token *token) {
+  switch (token->type) {
+  case TOKEN_STRING:
+    return token->start - 1;
+  case TOKEN_IDENTIFIER:
+  case TOKEN_NUMBER:
+  case TOKEN_AND ... TOKEN_WHILE:
+    return token->start;
+  case TOKEN_BANG_EQUAL:
+  case TOKEN_EQUAL_EQUAL:
+  case TOKEN_GREATER_EQUAL:
+  case TOKEN_LESS_EQUAL:
+    return token->start - 2;
+  default:
+    return token->start - 1; // single byte punctuators, the NUL of EOF
+  }
+}
+
+static void *edit_alloc(const EditBuffer *buffer, size_t size) {
+  void *memory = malloc(size);
+  if (memory == NULL) {
+    fprintf(stderr, ERROR ": memory allocation for file %s failed\n",
+            buffer->filename);
+    exit(LEXER_EXIT_FAILURE);
+  }
+  return memory;
+}
+
+// Widen the gap of a gap array of `count` items of `size` bytes to at least
+// `needed` items. The array doubles, so growing is amortized constant.
+static void *widen_gap(const EditBuffer *buffer, void *items, size_t size,
+                       size_t count, size_t gap, size_t *gap_len,
+                       size_t needed) {
+  if (*gap_len >= needed)
+    return items;
+  size_t wider = needed + count;
+  char *grown = edit_alloc(buffer, (count + wider) * size);
+  memcpy(grown, items, gap * size);
+  memcpy(grown + (gap + wider) * size, (char *)items + (gap + *gap_len) * size,
+         (count - gap) * size);
+  free(items);
+  *gap_len = wider;
+  return grown;
+}
+
+// Move `token` from the text at `from` to the one at `to`. Decoded strings
+// live in the arena and stay where they are.
+static void rebase_token(Token *token, const char *from, const char *to) {
+  if (token->value.type == TYPE_IDENTIFIER)
+    token->value.as.identifier_value.start =
+        to + (token->value.as.identifier_value.start - from);
+  else if (token->value.type == TYPE_STRING &&
+           token->value.as.string_value.start == token->start)
+    token->value.as.string_value.start =
+        to + (token->value.as.string_value.start - from);
+  token->start = to + (token->start - from);
+}
+
+static Token *token_slot(const EditBuffer *buffer, size_t index) {
+  return &buffer->tokens[index < buffer->token_gap
+                             ? index
+                             : index + buffer->token_gap_len];
+}
+
+static size_t line_start(const EditBuffer *buffer, size_t line) {
+  return line < buffer->line_gap
+             ? buffer->line_starts[line]
+             : buffer->length - buffer->line_starts[line + buffer->line_gap_len];
+}
+
+EditBuffer init_edit_buffer(Lexer *lexer) {
+  ASSERT(lexer->stream == NULL && lexer->symbols != NULL,
+         "Re-lexing needs the whole source");
+  ASSERT(lexer_exhausted(lexer), "Re-lexing a source that wasn't scanned");
+
+  size_t length = lexer->source_len;
+  EditBuffer buffer = {.filename = lexer->source_filename,
+                       .length = length,
+                       .gap = length,
+                       .gap_len = LEXER_EDIT_GAP};
+  buffer.text = edit_alloc(&buffer, length + buffer.gap_len + 1);
+  memcpy(buffer.text, lexer->source, length);
+  buffer.text[length + buffer.gap_len] = '\0';
+
+  // Every token lies in front of the gap but EOF, which begins at the
+  // sentinel.
+  size_t count = arrlenu(lexer->tokens);
+  buffer.token_count = count;
+  buffer.token_gap = count;
+  buffer.token_gap_len = 64;
+  buffer.tokens =
+      edit_alloc(&buffer, (count + buffer.token_gap_len) * sizeof(Token));
+  for (size_t i = 0; i < count; i++) {
+    Token token = lexer->tokens[i];
+    if (token.type == TOKEN_EOF) {
+      rebase_token(&token, lexer->source, buffer.text + buffer.gap_len);
+      buffer.token_gap = i;
+      buffer.tokens[i + buffer.token_gap_len] = token;
+    } else {
+      rebase_token(&token, lexer->source, buffer.text);
+      buffer.tokens[i] = token;
+    }
+  }
+
+  size_t lines = arrlenu(lexer->line_starts);
+  buffer.line_count = lines;
+  buffer.line_gap = lines;
+  buffer.line_gap_len = 64;
+  buffer.line_starts =
+      edit_alloc(&buffer, (lines + buffer.line_gap_len) * sizeof(uint32_t));
+  memcpy(buffer.line_starts, lexer->line_starts, lines * sizeof(uint32_t));
+
+  // Interned names are slices of the source, which is about to change.
+  buffer.symbols = lexer->symbols;
+  buffer.symbols->storage = calloc(1, sizeof(Arena));
+  if (buffer.symbols->storage == NULL) {
+    fprintf(stderr, ERROR ": memory allocation for symbol table failed\n");
+    exit(LEXER_EXIT_FAILURE);
+  }
+  for (size_t id = 0; id < arrlenu(buffer.symbols->names); id++) {
+    String *name = &buffer.symbols->names[id];
+    char *copy = arena_alloc(buffer.symbols->storage, name->length, 1);
+    memcpy(copy, name->start, name->length);
+    name->start = copy;
+  }
+  buffer.strings = lexer->strings;
+  lexer->symbols = NULL;
+  lexer->strings = NULL;
+  return buffer;
+}
+
+void free_edit_buffer(EditBuffer *buffer) {
+  free(buffer->text);
+  free(buffer->tokens);
+  free(buffer->line_starts);
+  free_symbol_table(buffer->symbols);
+  free(buffer->symbols);
+  free_arena(buffer->strings);
+  free(buffer->strings);
+  *buffer = (EditBuffer){0};
+}
+
+size_t edit_offset(const EditBuffer *buffer, const char *at) {
+  size_t index = (size_t)(at - buffer->text);
+  return index <= buffer->gap ? index : index - buffer->gap_len;
+}
+
+Token edit_token(const EditBuffer *buffer, size_t index) {
+  ASSERT(index < buffer->token_count, "Token index out of bounds");
+  return *token_slot(buffer, index);
+}
+
+void edit_position(const EditBuffer *buffer, const char *at, size_t *line,
+                   size_t *column) {
+  size_t offset = edit_offset(buffer, at);
+  size_t low = 0, high = buffer->line_count;
+  while (high - low > 1) {
+    size_t mid = low + (high - low) / 2;
+    if (line_start(buffer, mid) <= offset)
+      low = mid;
+    else
+      high = mid;
+  }
+  *line = low;
+  *column = offset - line_start(buffer, low);
+}
+
+// Move the gap to `to`, which no token straddles, along with the tokens whose
+// text crosses it.
+static void move_gap(EditBuffer *buffer, size_t to) {
+  char *text = buffer->text;
+  if (to < buffer->gap) {
+    memmove(text + to + buffer->gap_len, text + to, buffer->gap - to);
+    while (buffer->token_gap > 0) {
+      Token token = buffer->tokens[buffer->token_gap - 1];
+      if ((size_t)(token_begin(&token) - text) < to)
+        break;
+      rebase_token(&token, text, text + buffer->gap_len);
+      buffer->token_gap--;
+      buffer->tokens[buffer->token_gap + buffer->token_gap_len] = token;
+    }
+  } else {
+    while (buffer->token_gap < buffer->token_count) {
+      Token token = buffer->tokens[buffer->token_gap + buffer->token_gap_len];
+      if (edit_offset(buffer, token_begin(&token)) >= to)
+        break;
+      rebase_token(&token, text + buffer->gap_len, text);
+      buffer->tokens[buffer->token_gap++] = token;
+    }
+    memmove(text + buffer->gap, text + buffer->gap + buffer->gap_len,
+            to - buffer->gap);
+  }
+  buffer->gap = to;
+}
+
+// While re-lexing: move the gap on by about `step` bytes, stopping where an
+// old token begins, or at the end when no old token is left to stop at. The
+// old tokens from slot `moved` up to the one returned now lie in front of the
+// gap but are left behind the token gap.
+static size_t advance_gap(EditBuffer *buffer, size_t step, size_t moved,
+                          size_t slots) {
+  size_t to = buffer->length - buffer->gap > step ? buffer->gap + step
+                                                  : buffer->length;
+  size_t last = moved;
+  while (last < slots &&
+         edit_offset(buffer, token_begin(&buffer->tokens[last])) < to)
+    last++;
+  to = last < slots ? edit_offset(buffer, token_begin(&buffer->tokens[last]))
+                    : buffer->length;
+
+  char *text = buffer->text;
+  for (size_t i = moved; i < last; i++)
+    rebase_token(&buffer->tokens[i], text + buffer->gap_len, text);
+  memmove(text + buffer->gap, text + buffer->gap + buffer->gap_len,
+          to - buffer->gap);
+  buffer->gap = to;
+  return last;
+}
+
+// Make room for `needed` bytes and the sentinel in the gap. The text moves,
+// so every token is rebased; the buffer doubles, so that stays amortized
+// constant per byte.
+static void widen_text(EditBuffer *buffer, size_t needed) {
+  if (buffer->gap_len > needed)
+    return;
+  size_t gap_len = needed + 1 +
+                   (buffer->length > LEXER_EDIT_GAP ? buffer->length
+                                                      : LEXER_EDIT_GAP);
+  char *text = edit_alloc(buffer, buffer->length + gap_len + 1);
+  memcpy(text, buffer->text, buffer->gap);
+  memcpy(text + buffer->gap + gap_len,
+         buffer->text + buffer->gap + buffer->gap_len,
+         buffer->length - buffer->gap + 1);
+  for (size_t i = 0; i < buffer->token_count; i++) {
+    if (i < buffer->token_gap)
+      rebase_token(token_slot(buffer, i), buffer->text, text);
+    else
+      rebase_token(token_slot(buffer, i), buffer->text + buffer->gap_len,
+                   text + gap_len);
+  }
+  free(buffer->text);
+  buffer->text = text;
+  buffer->gap_len = gap_len;
+}
+
+// Bring the line starts up to date with an edit, before `length` changes.
+static void edit_lines(EditBuffer *buffer, size_t start, size_t end,
+                       const char *replacement, size_t replacement_len) {
+  // Lines beginning up to `start` go in front of the gap.
+  uint32_t *lines = buffer->line_starts;
+  while (buffer->line_gap > 0 && lines[buffer->line_gap - 1] > start) {
+    buffer->line_gap--;
+    lines[buffer->line_gap + buffer->line_gap_len] =
+        (uint32_t)(buffer->length - lines[buffer->line_gap]);
+  }
+  while (buffer->line_gap < buffer->line_count &&
+         line_start(buffer, buffer->line_gap) <= start) {
+    lines[buffer->line_gap] = (uint32_t)line_start(buffer, buffer->line_gap);
+    buffer->line_gap++;
+  }
+
+  // Lines begun by newlines that are edited away go into the gap.
+  while (buffer->line_gap < buffer->line_count &&
+         line_start(buffer, buffer->line_gap) <= end) {
+    buffer->line_gap_len++;
+    buffer->line_count--;
+  }
+
+  const char *p = replacement, *stop = replacement + replacement_len;
+  buffer->line_starts =
+      widen_gap(buffer, lines, sizeof(uint32_t), buffer->line_count,
+                buffer->line_gap, &buffer->line_gap_len,
+                count_newlines(p, stop));
+  while ((p = find_byte(p, stop, '\n')) < stop) {
+    p++;
+    buffer->line_starts[buffer->line_gap++] =
+        (uint32_t)(start + (p - replacement));
+    buffer->line_gap_len--;
+    buffer->line_count++;
+  }
+}
+
+// Replace the bytes in [start, end) of the text with `replacement` and bring
+// the tokens and line starts up to date. Besides lexing the tokens the edit
+// touches, the work is in moving the gap from the previous edit, so edits
+// close to each other stay cheap however long the text is.
+TokenEdit relex_edit(EditBuffer *buffer, size_t start, size_t end,
+                     const char *replacement, size_t replacement_len) {
+  ASSERT(start <= end && end <= buffer->length, "Edit out of bounds");
+  size_t length = buffer->length - (end - start) + replacement_len;
+  if (length >= UINT32_MAX) {
+    fprintf(stderr, ERROR ": file %s is too large to lex in memory\n",
+            buffer->filename);
+    exit(LEXER_EXIT_FAILURE);
+  }
+
+  // The token before the last one beginning ahead of the edit: the lexer
+  // looks up to two bytes past a token, so that one may read edited bytes.
+  size_t count = buffer->token_count;
+  size_t low = 0, high = count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (edit_offset(buffer, token_begin(token_slot(buffer, mid))) < start)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  size_t first = low >= 2 ? low - 2 : 0;
+  size_t resume =
+      low > 0 ? edit_offset(buffer, token_begin(token_slot(buffer, first)))
+              : 0;
+
+  // Old tokens beginning at or behind `end` may resynchronize; those in front
+  // of them are dropped.
+  size_t next = low;
+  while (next < count &&
+         edit_offset(buffer, token_begin(token_slot(buffer, next))) < end)
+    next++;
+  move_gap(buffer, resume);
+  buffer->token_gap_len += next - first;
+  buffer->token_count -= next - first;
+
+  // Open the gap at `start` over the removed bytes and fill in the
+  // replacement.
+  edit_lines(buffer, start, end, replacement, replacement_len);
+  char *text = buffer->text;
+  memmove(text + resume, text + resume + buffer->gap_len, start - resume);
+  buffer->gap = start;
+  buffer->gap_len += end - start;
+  buffer->length -= end - start;
+  widen_text(buffer, replacement_len);
+  text = buffer->text;
+  if (replacement_len > 0)
+    memcpy(text + buffer->gap, replacement, replacement_len);
+  buffer->gap += replacement_len;
+  buffer->gap_len -= replacement_len;
+  buffer->length = length;
+
+  size_t after = buffer->token_gap + buffer->token_gap_len;
+  size_t slots = after + buffer->token_count - buffer->token_gap;
+  text[buffer->gap] = '\0';
+  Lexer relexer = new_lexer(buffer->filename, text, buffer->gap);
+  relexer.current = text + resume;
+  relexer.partial = buffer->gap < length;
+  relexer.strings = buffer->strings;
+  relexer.silent = true;
+  Token *fresh = NULL;
+  size_t moved = after, synced_at = after;
+  // Lexing usually resynchronizes a token or two past the edit, so the gap
+  // first moves on a little, then further each time it is run into again.
+  size_t step = 32;
+  bool synced = false;
+  while (!synced && !lexer_exhausted(&relexer)) {
+    Lexer saved = relexer;
+    Token token = lex_token(&relexer);
+    // As in `next_token`: a token that may have been cut short by the gap is
+    // lexed again with more text in front of it.
+    if (relexer.partial && token.type != TOKEN_ERROR &&
+        relexer.current + 1 >= text + buffer->gap) {
+      relexer = saved;
+      moved = advance_gap(buffer, step, moved, slots);
+      step *= 2;
+      text[buffer->gap] = '\0';
+      relexer.source_len = buffer->gap;
+      relexer.partial = buffer->gap < length;
+      continue;
+    }
+    if (token.type == TOKEN_COMMENT || token.type == TOKEN_ERROR)
+      continue;
+
+    size_t begin = (size_t)(token_begin(&token) - text);
+    if (begin >= start + replacement_len) {
+      while (synced_at < slots &&
+             edit_offset(buffer, token_begin(&buffer->tokens[synced_at])) <
+                 begin)
+        synced_at++;
+      synced = synced_at < slots &&
+               edit_offset(buffer, token_begin(&buffer->tokens[synced_at])) ==
+                   begin;
+      if (synced)
+        break;
+    }
+    // Names are interned only now, as a token cut short by the gap must not
+    // leave its prefix in the table.
+    if (token.type == TOKEN_IDENTIFIER)
+      token.symbol = intern_symbol(buffer->symbols, token.start,
+                                   token.value.as.identifier_value.length);
+    arrput(fresh, token);
+  }
+  if (!synced)
+    synced_at = slots;
+
+  // Swap the old tokens in front of `synced_at` for the new ones.
+  size_t dropped = synced_at - after;
+  buffer->token_gap_len += dropped;
+  buffer->token_count -= dropped;
+  size_t inserted = arrlenu(fresh);
+  buffer->tokens =
+      widen_gap(buffer, buffer->tokens, sizeof(Token), buffer->token_count,
+                buffer->token_gap, &buffer->token_gap_len, inserted);
+  if (inserted > 0)
+    memcpy(&buffer->tokens[buffer->token_gap], fresh,
+           inserted * sizeof(Token));
+  buffer->token_gap += inserted;
+  buffer->token_gap_len -= inserted;
+  buffer->token_count += inserted;
+  arrfree(fresh);
 
-    if (lexer->finished)
+  // A new EOF begins at the sentinel, behind the gap like the old one.
+  if (inserted > 0 &&
+      buffer->tokens[buffer->token_gap - 1].type == TOKEN_EOF) {
+    buffer->token_gap--;
+    Token eof = buffer->tokens[buffer->token_gap];
+    rebase_token(&eof, text, text + buffer->gap_len);
+    buffer->tokens[buffer->token_gap + buffer->token_gap_len] = eof;
+  }
+  // Old tokens the gap moved past join the ones in front of it.
+  while (buffer->token_gap < buffer->token_count) {
+    Token *token = &buffer->tokens[buffer->token_gap + buffer->token_gap_len];
+    if ((size_t)(token_begin(token) - text) >= buffer->gap)
       break;
+    buffer->tokens[buffer->token_gap++] = *token;
+  }
+
+  return (TokenEdit){
+      .first = first, .removed = next - first + dropped, .inserted = inserted};
+}
+
+// Compact token stream
+
+static void stream_push(TokenStream *stream, const Token *token) {
+  uint32_t payload = 0;
+  switch (token->type) {
+  case TOKEN_IDENTIFIER:
+    ASSERT(token->symbol != SYMBOL_NONE, "Identifier was not interned");
+    payload = token->symbol;
+    break;
+  case TOKEN_STRING:
+    payload = (uint32_t)token->value.as.string_value.length;
+    // Decoded strings, and slices too long to tell apart from an index.
+    if (token->value.as.string_value.start != token->start ||
+        token->value.as.string_value.length >= STREAM_STRING_INDEX) {
+      payload = STREAM_STRING_INDEX | (uint32_t)arrlenu(stream->strings);
+      arrput(stream->strings, token->value.as.string_value);
+    }
+    break;
+  case TOKEN_NUMBER:
+    payload = (uint32_t)arrlenu(stream->numbers);
+    arrput(stream->numbers, token->value.as.number_value);
+    break;
+  default:
+    break;
+  }
+
+  arrput(stream->types, (uint8_t)token->type);
+  arrput(stream->offsets, (uint32_t)(token->start - stream->source));
+  arrput(stream->payloads, payload);
+}
+
+// Lex the whole source straight into a compact stream. Offsets are 32 bit, so
+// sources are limited to 4 GiB.
+TokenStream scan_token_stream(Lexer *lexer) {
+  ASSERT(lexer->stream == NULL && lexer->symbols != NULL,
+         "Compact token streams need the whole source");
+  if (lexer->source_len >= UINT32_MAX) {
+    fprintf(stderr, ERROR ": file %s is too large to parse\n",
+            lexer->source_filename);
+    exit(LEXER_EXIT_FAILURE);
+  }
+
+  TokenStream stream = {.source = lexer->source, .symbols = lexer->symbols};
+
+  size_t threads = lexing_threads(lexer);
+  if (threads > 1)
+    scan_tokens_parallel(lexer, threads, &stream);
+  else
+    scan_until(lexer, NULL, &stream);
+
+  return stream;
+}
+
+void free_token_stream(TokenStream *stream) {
+  arrfree(stream->types);
+  arrfree(stream->offsets);
+  arrfree(stream->payloads);
+  arrfree(stream->numbers);
+  arrfree(stream->strings);
+  *stream = (TokenStream){0};
+}
+
+size_t stream_length(const TokenStream *stream) {
+  return arrlenu(stream->types);
+}
+
+// Reading past the last token yields EOF.
+TokenType stream_token_type(const TokenStream *stream, size_t index) {
+  if (index >= arrlenu(stream->types))
+    return TOKEN_EOF;
+  return (TokenType)stream->types[index];
+}
+
+Token stream_token(const TokenStream *stream, size_t index) {
+  TokenType type = stream_token_type(stream, index);
+  if (index >= arrlenu(stream->types))
+    return (Token){.type = type,
+                   .symbol = SYMBOL_NONE,
+                   .value = {.type = TYPE_NULL}};
+
+  const char *start = stream->source + stream->offsets[index];
+  uint32_t payload = stream->payloads[index];
+  SymbolId symbol = SYMBOL_NONE;
+  Value value = {.type = TYPE_NULL};
+  switch (type) {
+  case TOKEN_IDENTIFIER:
+    symbol = payload;
+    value = (Value){.type = TYPE_IDENTIFIER,
+                    .as.identifier_value = {
+                        .start = start,
+                        .length = symbol_name(stream->symbols, symbol).length}};
+    break;
+  case TOKEN_STRING:
+    value = (Value){.type = TYPE_STRING,
+                    .as.string_value = {.start = start, .length = payload}};
+    if (payload & STREAM_STRING_INDEX)
+      value.as.string_value = stream->strings[payload & ~STREAM_STRING_INDEX];
+    break;
+  case TOKEN_NUMBER:
+    value = (Value){.type = TYPE_NUMBER,
+                    .as.number_value = stream->numbers[payload]};
+    break;
+  case TOKEN_TRUE:
+    value = (Value){.type = TYPE_BOOL, .as.bool_value = true};
+    break;
+  case TOKEN_FALSE:
+    value = (Value){.type = TYPE_BOOL, .as.bool_value = false};
+    break;
+  default:
+    break;
   }
+
+  return (Token){.type = type,
+                 .symbol = symbol,
+                 .start = start,
+                 .value = value};
 }
@@ -2,10 +2,18 @@
 #ifndef LEXER_H
 #define LEXER_H
 
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #define LEXER_EXIT_FAILURE 1
-#define MAX_NUMBER_DIGITS 256
+#ifndef LEXER_STREAM_CHUNK
+#define LEXER_STREAM_CHUNK (64 * 1024)
+#endif
+// Smallest slice of the source worth handing to a lexing thread.
+#ifndef LEXER_PARALLEL_CHUNK
+#define LEXER_PARALLEL_CHUNK (4 * 1024 * 1024)
+#endif
 
 #include "stb_ds.h"
 
@@ -66,32 +74,6 @@ typedef struct {
 
 extern const TokenRepr TOKEN_REPRESENTATIONS[TOKEN_TYPE_LEN];
 
-typedef struct {
-    const char* keyword;
-    TokenType type;
-} Keyword;
-
-// TODO: token TOKEN_REPRESENTATIONS has this data
-static const Keyword KEYWORDS[] = {
-    {"and",    TOKEN_AND},
-    {"class",  TOKEN_CLASS},
-    {"else",   TOKEN_ELSE},
-    {"false",  TOKEN_FALSE},
-    {"for",    TOKEN_FOR},
-    {"fun",    TOKEN_FUN},
-    {"if",     TOKEN_IF},
-    {"nil",    TOKEN_NIL},
-    {"or",     TOKEN_OR},
-    {"print",  TOKEN_PRINT},
-    {"return", TOKEN_RETURN},
-    {"super",  TOKEN_SUPER},
-    {"this",   TOKEN_THIS},
-    {"true",   TOKEN_TRUE},
-    {"var",    TOKEN_VAR},
-    {"while",  TOKEN_WHILE}
-};
-
-
 typedef struct {
     const char* start;
     size_t length;
@@ -113,45 +95,190 @@ typedef struct {
     } as;
 } Value;
 
+// Dense id of an interned identifier, see `SymbolTable`.
+typedef uint32_t SymbolId;
+#define SYMBOL_NONE UINT32_MAX
+
 typedef struct {
   TokenType type;
-  // string location in the source
-  size_t line;
+  SymbolId symbol; // identifiers only, SYMBOL_NONE if not interned
+  // string location in the source, see `lexer_position`
   const char* start;
 
   // maybe parsed value
   Value value;
 } Token;
 
-#define PRINT_AS_STRING(KIND, TOKEN)                                   \
-  for (size_t i = 0; i < (TOKEN)->value.as.KIND##_value.length; i++) { \
-    printf("%c", (TOKEN)->value.as.KIND##_value.start[i]);             \
-  }                                                                    \
+// See utils.h.
+typedef struct Arena Arena;
+typedef struct Output Output;
+typedef struct SourceHash SourceHash;
 
+// Identifier interning: every distinct name gets the next dense SymbolId.
+// Names are slices of the source they were lexed from, unless the table has
+// `storage`; `hashes` keeps each name's hash so growing the open addressing
+// `slots` doesn't rehash names.
+typedef struct {
+  String* names;     // Vec<String>, indexed by SymbolId
+  uint32_t* hashes;  // Vec<uint32_t>, indexed by SymbolId
+  uint32_t* slots;   // SymbolId + 1 per slot, 0 when empty
+  size_t capacity;   // number of slots, a power of two
+  // Owned; when set, every name is copied into it once, for sources that
+  // change under the table.
+  Arena* storage;
+} SymbolTable;
 
 typedef struct {
   const char *current;
   const char *source;
   size_t source_len;
   const char* source_filename;
+  bool source_mapped; // `source` is an mmap'd view, not a heap copy
+  // Threads `scan_tokens` may lex on, 0 for one per CPU. Callers that
+  // already run a lexer per CPU set it to 1.
+  size_t max_threads;
+
+  // Streaming input: `source` is a heap window over `stream` that is
+  // refilled as tokens are pulled. Tokens from a streaming lexer (and the
+  // slices they hold) are only valid until the next call to `next_token`.
+  FILE* stream;
+  size_t window_capacity;
+  bool partial; // more input follows the current window
+  SourceHash* stream_hash; // when set, fed every byte read from `stream`
 
   Token* tokens;  // Vec<Token>
+  // Owned; NULL for streaming lexers, whose source window doesn't outlive
+  // the tokens.
+  SymbolTable* symbols;
+  // Owned; the decoded text of string literals with escapes. Literals
+  // without escapes are slices of the source. Streaming lexers reset it on
+  // every token.
+  Arena* strings;
 
-  size_t line;
-  size_t line_offset;
+  // Offset at which each line begins, built once up front so positions are
+  // only worked out when needed. Streaming lexers instead track where their
+  // window starts.
+  uint32_t* line_starts; // Vec<uint32_t>
+  size_t window_line;
+  size_t window_column;
+  size_t window_offset; // bytes of the stream dropped in front of the window
 
   // Runtime helpful flags
   bool finished;
   bool had_error;
+  bool silent; // don't report errors (speculative lexing)
+  // Where errors are reported, each flushed as it is written; stderr when
+  // NULL.
+  Output* errors;
 } Lexer;
 
 typedef struct {
     Lexer lexer;
 } Lox ;
 
+SymbolId intern_symbol(SymbolTable* table, const char* name, size_t length);
+String symbol_name(const SymbolTable* table, SymbolId symbol);
+void free_symbol_table(SymbolTable* table);
+
+// Compact structure-of-arrays token store: 9 bytes per token (plus 8 per
+// number) instead of a full `Token`. `stream_token` rebuilds the equivalent
+// `Token`.
+typedef struct {
+  const char* source;
+  uint8_t* types;         // Vec<TokenType>
+  uint32_t* offsets;      // Vec<uint32_t>, `Token.start` relative to `source`
+  uint32_t* payloads;     // Vec<uint32_t>, SymbolId for identifiers, slice
+                          // length for strings (or STREAM_STRING_INDEX and
+                          // an index into `strings`), index into `numbers`
+                          // for numbers
+  double* numbers;        // Vec<double>
+  String* strings;        // Vec<String>, decoded string literals, in the
+                          // lexer's arena
+  const SymbolTable* symbols; // the lexer's, which must outlive the stream
+} TokenStream;
+
+
+#define STREAM_STRING_INDEX 0x80000000u
 
-Lexer init_lexer(const char* filename, const char* source);
+// String literals: `\"`, `\\`, `\n`, `\r` and `\t` are the escapes.
+// `start` is just past the opening quote; returns the closing quote, or `end`
+// if there is none.
+const char* string_literal_end(const char* start, const char* end);
+// Decode the escapes of the literal contents [start, end) into `out`, which
+// must hold `end - start` bytes. Returns the offending backslash if there is
+// an invalid escape, NULL otherwise.
+const char* decode_escapes(const char* start, const char* end, char* out,
+                           size_t* length);
+
+Lexer init_lexer(const char* filename, const char* source, size_t source_len);
+Lexer init_stream_lexer(const char* filename, FILE* stream,
+                        SourceHash* hash);
 void free_lexer(Lexer* lexer);
 void scan_tokens(Lexer* lexer);
 Token next_token(Lexer* lexer);
+bool lexer_exhausted(const Lexer* lexer);
+void lexer_position(const Lexer* lexer, const char* at, size_t* line,
+                    size_t* column);
+
+// Incremental re-lexing, for editors and the REPL: a scanned source that is
+// edited in place. The text is a gap buffer and the tokens a gap array, both
+// split where the last edit was made. Text behind the gap sits at the end of
+// the buffer, so tokens on either side keep pointing at it while edits come
+// in at the gap; an edit only rewrites the tokens it touches and the ones the
+// gap moves past. Line starts are kept the same way, behind the gap as
+// distances from the end of the text.
+typedef struct {
+  const char* filename;
+  char* text;    // `length` bytes around the gap, then a NUL sentinel
+  size_t length;
+  size_t gap;    // offset in the text where the gap is
+  size_t gap_len;
+
+  Token* tokens; // `token_count` tokens around a gap of `token_gap_len`
+  size_t token_count;
+  size_t token_gap; // tokens in front of the gap, which lie in front of
+                    // the text's gap
+  size_t token_gap_len;
+
+  uint32_t* line_starts; // `line_count` around a gap of `line_gap_len`
+  size_t line_count;
+  size_t line_gap;
+  size_t line_gap_len;
+
+  SymbolTable* symbols; // owned, with `storage`
+  Arena* strings;       // owned, see `Lexer.strings`
+} EditBuffer;
+// Least size of the gap in an `EditBuffer`'s text.
+#ifndef LEXER_EDIT_GAP
+#define LEXER_EDIT_GAP (4 * 1024)
+#endif
+
+// Tokens replaced by `relex_edit`: `removed` old tokens starting at `first`
+// were replaced by `inserted` new ones.
+typedef struct {
+  size_t first;
+  size_t removed;
+  size_t inserted;
+} TokenEdit;
+
+// Copy the source and tokens of a lexer that `scan_tokens` ran on and take
+// over its symbols and strings; the lexer is still freed as usual. Edits are
+// lexed silently.
+EditBuffer init_edit_buffer(Lexer* lexer);
+void free_edit_buffer(EditBuffer* buffer);
+TokenEdit relex_edit(EditBuffer* buffer, size_t start, size_t end,
+                     const char* replacement, size_t replacement_len);
+// Tokens point into the text and stay valid until the next edit.
+Token edit_token(const EditBuffer* buffer, size_t index);
+// Offset in the text of a pointer into it, e.g. `Token.start`.
+size_t edit_offset(const EditBuffer* buffer, const char* at);
+// Zero based line and column, as with `lexer_position`.
+void edit_position(const EditBuffer* buffer, const char* at, size_t* line,
+                   size_t* column);
+
+TokenStream scan_token_stream(Lexer* lexer);
+void free_token_stream(TokenStream* stream);
+size_t stream_length(const TokenStream* stream);
+TokenType stream_token_type(const TokenStream* stream, size_t index);
+Token stream_token(const TokenStream* stream, size_t index);
 #endif // LEXER_H
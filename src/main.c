@@ -1,41 +1,310 @@
 #include "ast.h"
+#include "cache.h"
+#include "dump.h"
 #include "lexer.h"
 #include "utils.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-void usage() { fprintf(stderr, "Usage: clox tokenize <filename>\n"); }
+void usage() {
+  fprintf(stderr,
+          "Usage: clox tokenize [--format=text|bin] [--jobs N] <filename>...\n"
+          "       clox parse [--cache=DIR] [--jobs N] <filename>...\n");
+}
+
+typedef struct {
+  bool parse; // `parse` rather than `tokenize`
+  bool binary;
+  const char *cache_directory;
+  size_t lexing_threads; // for `Lexer.max_threads`
+} Options;
 
-Lexer lex(const char *filepath) {
-  char *file_contents = read_file_contents(filepath);
+// Load `filepath` into a lexer that reports to `errors`; `parse` scans it
+// into a compact stream.
+bool lex(const char *filepath, Lexer *lexer, Output *errors) {
+  size_t length = 0;
+  const char *file_contents = map_file_contents(filepath, &length);
+  bool mapped = file_contents != NULL;
+  if (!mapped)
+    file_contents = read_file_contents(filepath, &length);
   if (file_contents == NULL) {
-    fprintf(stderr, ERROR "couldn't read input file [%s]", filepath);
-    exit(LEXER_EXIT_FAILURE);
+    report_error(errors, "couldn't read input file [%s]", filepath);
+    return false;
   }
 
-  ASSERT(strlen(file_contents) > 0,
-         "File read output is less than or equal to.");
+  if (length == 0) {
+    report_error(errors, "file [%s] is empty", filepath);
+    free((char *)file_contents);
+    return false;
+  }
+
+  *lexer = init_lexer(filepath, file_contents, length);
+  lexer->source_mapped = mapped;
+  lexer->errors = errors;
+  return true;
+}
 
+// Lex `filepath` through a bounded window, for consumers that handle each
+// token as it is produced. `hash`, if not NULL, is fed the whole file.
+bool lex_stream(const char *filepath, Lexer *lexer, SourceHash *hash,
+                Output *errors) {
+  FILE *file = fopen(filepath, "rb");
+  if (file == NULL) {
+    report_error(errors, "couldn't read input file [%s]", filepath);
+    return false;
+  }
+
+  *lexer = init_stream_lexer(filepath, file, hash);
+  if (lexer->source_len == 0) {
+    report_error(errors, "file [%s] is empty", filepath);
+    free_lexer(lexer);
+    return false;
+  }
+  lexer->errors = errors;
+  return true;
+}
+
+// Each command writes one file's output to `out` and its diagnostics to
+// `errors`, which flushes `out` ahead of it, and returns its exit status.
+int tokenize_file(const Options *options, const char *filename, Output *out,
+                  Output *errors) {
+  // Tokens are written as they are lexed so memory stays bounded. A dump
+  // ends with the hash of the source, which is complete once it's all read.
   Lexer lexer;
-  if (strlen(file_contents) > 0) {
-    lexer = init_lexer(filepath, file_contents);
+  SourceHash hash = init_source_hash();
+  if (!lex_stream(filename, &lexer, options->binary ? &hash : NULL, errors))
+    return LEXER_EXIT_FAILURE;
+
+  if (options->binary)
+    write_token_dump_header(out);
+  while (!lexer_exhausted(&lexer)) {
+    Token token = next_token(&lexer);
+    if (token.type == TOKEN_COMMENT || token.type == TOKEN_ERROR)
+      continue;
+    if (options->binary)
+      write_token_record(out, &lexer, &token);
+    else
+      display_token(out, &token);
+  }
+  if (options->binary)
+    write_token_dump_trailer(out, &hash);
+
+  bool had_error = lexer.had_error;
+  free_lexer(&lexer);
+  if (had_error) {
+    report_error(errors, "lexer had errors [%s].", filename);
+    return LEXER_EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
 
-    scan_tokens(&lexer);
+int parse_file(const Options *options, const char *filename, Output *out,
+               Output *errors) {
+  Lexer lexer;
+  if (!lex(filename, &lexer, errors))
+    return LEXER_EXIT_FAILURE;
+  lexer.max_threads = options->lexing_threads;
+
+  const char *cache_directory = options->cache_directory;
+  Parser parser;
+  if (cache_directory == NULL ||
+      !load_parse_cache(cache_directory, &lexer, &parser)) {
+    parser = parse(&lexer);
+    // Sources with errors are left out so the errors show every run.
+    if (cache_directory != NULL && !lexer.had_error && !parser.had_error)
+      store_parse_cache(cache_directory, &lexer, &parser);
+  }
+
+  int status = EXIT_SUCCESS;
+  if (parser.had_error) {
+    status = AST_EXIT_FAILURE;
   } else {
-    fprintf(stderr, ERROR "file [%s] is empty", filepath);
-    exit(LEXER_EXIT_FAILURE);
+    print_ast(&parser, out);
+    output_string(out, "\n");
   }
+  free_parser(&parser);
+  free_lexer(&lexer);
+  return status;
+}
 
-  return lexer;
+int run_file(const Options *options, const char *filename, Output *out,
+             Output *errors) {
+  return options->parse ? parse_file(options, filename, out, errors)
+                        : tokenize_file(options, filename, out, errors);
 }
 
-int main(int argc, char *argv[]) {
-  // TODO: do we need this ?
-  // Disable output buffering
-  setbuf(stdout, NULL);
-  setbuf(stderr, NULL);
+// Batch runs: workers take the next file and run it, and whatever the job's
+// outputs flush lands in `spill_job`. The job whose turn it is writes
+// straight to stdout and stderr; the others hold their output, both streams
+// in the order it was written, until the main thread gets to them.
+typedef struct {
+  FILE *sink;
+  size_t end; // of this stretch of `Job.held`
+} Stretch;
+
+typedef struct Batch Batch;
+
+typedef struct {
+  const char *filename;
+  Batch *batch;
+  Output out;
+  Output errors;
+  Output held;        // flushed before the job's turn
+  Stretch *stretches; // Vec<Stretch>, which sink each part of `held` is for
+  int status;
+  bool done;
+} Job;
+
+struct Batch {
+  const Options *options;
+  Job *jobs;
+  size_t count;
+  size_t next; // next job to hand out
+  size_t turn; // the job that writes straight through
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+};
 
+static void spill_job(Output *out, const char *bytes, size_t length) {
+  Job *job = out->context;
+  Batch *batch = job->batch;
+  pthread_mutex_lock(&batch->lock);
+  bool turn = &batch->jobs[batch->turn] == job;
+  if (!turn) {
+    output_write(&job->held, bytes, length);
+    size_t count = arrlenu(job->stretches);
+    if (count > 0 && job->stretches[count - 1].sink == out->sink)
+      job->stretches[count - 1].end = job->held.length;
+    else
+      arrput(job->stretches,
+             ((Stretch){.sink = out->sink, .end = job->held.length}));
+  }
+  pthread_mutex_unlock(&batch->lock);
+
+  if (turn) {
+    fwrite(bytes, 1, length, out->sink);
+    fflush(out->sink);
+  }
+}
+
+static void *run_jobs(void *arg) {
+  Batch *batch = arg;
+  for (;;) {
+    size_t index = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+    if (index >= batch->count)
+      return NULL;
+
+    Job *job = &batch->jobs[index];
+    job->out = (Output){.sink = stdout, .spill = spill_job, .context = job};
+    job->errors = (Output){.sink = stderr,
+                           .ahead = &job->out,
+                           .spill = spill_job,
+                           .context = job};
+    int status =
+        run_file(batch->options, job->filename, &job->out, &job->errors);
+    free_output(&job->errors);
+    free_output(&job->out);
+
+    pthread_mutex_lock(&batch->lock);
+    job->status = status;
+    job->done = true;
+    pthread_cond_broadcast(&batch->finished);
+    pthread_mutex_unlock(&batch->lock);
+  }
+}
+
+// Returns the status of the first file that failed.
+static int run_batch(const Options *options, const char **filenames,
+                     size_t count, size_t threads) {
+  int status = EXIT_SUCCESS;
+  if (threads <= 1 || count <= 1) {
+    Output out = {.sink = stdout};
+    Output errors = {.sink = stderr, .ahead = &out};
+    for (size_t i = 0; i < count; i++) {
+      int file_status = run_file(options, filenames[i], &out, &errors);
+      output_flush(&out);
+      if (status == EXIT_SUCCESS)
+        status = file_status;
+    }
+    free_output(&errors);
+    free_output(&out);
+    return status;
+  }
+
+  // Workers already keep every CPU busy, so each lexes on its own thread.
+  Options worker_options = *options;
+  worker_options.lexing_threads = 1;
+  Batch batch = {.options = &worker_options,
+                 .jobs = calloc(count, sizeof(Job)),
+                 .count = count,
+                 .next = 0,
+                 .turn = 0};
+  pthread_t *workers = malloc(threads * sizeof(pthread_t));
+  if (batch.jobs == NULL || workers == NULL) {
+    fprintf(stderr, ERROR ": memory allocation for %zu jobs failed\n", count);
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < count; i++) {
+    batch.jobs[i].filename = filenames[i];
+    batch.jobs[i].batch = &batch;
+  }
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.finished, NULL);
+
+  if (threads > count)
+    threads = count;
+  for (size_t i = 0; i < threads; i++) {
+    if (pthread_create(&workers[i], NULL, run_jobs, &batch) != 0) {
+      fprintf(stderr, ERROR ": couldn't start worker thread\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    Job *job = &batch.jobs[i];
+    pthread_mutex_lock(&batch.lock);
+    // The job may hold more while what it held is written, so its turn only
+    // comes once nothing is left.
+    while (job->held.length > 0) {
+      Output held = job->held;
+      Stretch *stretches = job->stretches;
+      job->held = (Output){0};
+      job->stretches = NULL;
+      pthread_mutex_unlock(&batch.lock);
+
+      size_t start = 0;
+      for (size_t s = 0; s < arrlenu(stretches); s++) {
+        fwrite(held.data + start, 1, stretches[s].end - start,
+               stretches[s].sink);
+        fflush(stretches[s].sink);
+        start = stretches[s].end;
+      }
+      free_output(&held);
+      arrfree(stretches);
+      pthread_mutex_lock(&batch.lock);
+    }
+    batch.turn = i;
+    while (!job->done)
+      pthread_cond_wait(&batch.finished, &batch.lock);
+    pthread_mutex_unlock(&batch.lock);
+
+    if (status == EXIT_SUCCESS)
+      status = job->status;
+  }
+
+  for (size_t i = 0; i < threads; i++)
+    pthread_join(workers[i], NULL);
+  pthread_cond_destroy(&batch.finished);
+  pthread_mutex_destroy(&batch.lock);
+  free(workers);
+  free(batch.jobs);
+  return status;
+}
+
+int main(int argc, char *argv[]) {
   if (argc < 3) {
     usage();
     return 1;
@@ -44,30 +313,65 @@ int main(int argc, char *argv[]) {
   ASSERT(argc >= 3, "Less arguments than expected.");
 
   const char *command = argv[1];
+  Options options = {0};
+  if (strcmp(command, "parse") == 0) {
+    options.parse = true;
+  } else if (strcmp(command, "tokenize") != 0) {
+    fprintf(stderr, ERROR ": Unknown command: %s\n", command);
+    usage();
+    return 64;
+  }
 
-  if (strcmp(command, "tokenize") == 0) {
-    // Read file
-    Lexer lexer = lex(argv[2]);
-    for (size_t i = 0; (int)i < arrlen(lexer.tokens); i++) {
-      display_token(&lexer.tokens[i]);
-    }
-    if (lexer.had_error) {
-      fprintf(stderr, ERROR ": lexer had errors [%s].\n", argv[2]);
-      exit(LEXER_EXIT_FAILURE);
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t threads = online > 0 ? (size_t)online : 1;
+  const char **filenames = calloc(argc, sizeof(char *));
+  if (filenames == NULL) {
+    fprintf(stderr, ERROR ": memory allocation for arguments failed\n");
+    return EXIT_FAILURE;
+  }
+  size_t count = 0;
+  for (int i = 2; i < argc; i++) {
+    const char *jobs = NULL;
+    if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+      jobs = argv[++i];
+    else if (strncmp(argv[i], "--jobs=", 7) == 0)
+      jobs = argv[i] + 7;
+
+    if (jobs != NULL) {
+      char *end;
+      long value = strtol(jobs, &end, 10);
+      if (*jobs == '\0' || *end != '\0' || value < 1) {
+        fprintf(stderr, ERROR ": Invalid job count: %s\n", jobs);
+        usage();
+        return 64;
+      }
+      threads = (size_t)value;
+    } else if (!options.parse && strcmp(argv[i], "--format=text") == 0) {
+      options.binary = false;
+    } else if (!options.parse && strcmp(argv[i], "--format=bin") == 0) {
+      options.binary = true;
+    } else if (options.parse && strncmp(argv[i], "--cache=", 8) == 0 &&
+               argv[i][8] != '\0') {
+      options.cache_directory = argv[i] + 8;
+    } else if (strncmp(argv[i], "--", 2) == 0) {
+      fprintf(stderr, ERROR ": Unexpected argument: %s\n", argv[i]);
+      usage();
+      return 64;
+    } else {
+      filenames[count++] = argv[i];
     }
-    free_lexer(&lexer);
-    exit(EXIT_SUCCESS);
-  } else if (strcmp(command, "parse") == 0) {
-    Lexer lexer = lex(argv[2]);
-    Parser parser = parse(&lexer);
-    expr_accept(parser.root, (ExprVisitor *)&AstPrinter);
-    free_parser(&parser);
-    printf("\n");
-  } else {
-    fprintf(stderr, ERROR ": Unknown command: %s\n", command);
+  }
+  if (count == 0) {
     usage();
+    return 1;
+  }
+  // Dumps are read back whole, so they can't be concatenated.
+  if (options.binary && count > 1) {
+    fprintf(stderr, ERROR ": --format=bin takes a single file\n");
     return 64;
   }
 
-  return EXIT_SUCCESS;
+  int status = run_batch(&options, filenames, count, threads);
+  free(filenames);
+  return status;
 }
@@ -1,37 +1,140 @@
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "utils.h"
 #include "lexer.h"
 
-char *read_file_contents(const char *filename) {
-  FILE *file = fopen(filename, "r");
-  if (file == NULL) {
-    fprintf(stderr, ERROR": reading file: %s\n", filename);
+// Content hash of a source: four independent multiply-xorshift lanes over 32
+// byte blocks keep hashing far cheaper than lexing. The bytes after the last
+// whole block are mixed in at the end, so a source read in pieces hashes the
+// same as one in memory.
+SourceHash init_source_hash(void) {
+  return (SourceHash){.lanes = {0x243F6A8885A308D3ULL, 0x13198A2E03707344ULL,
+                                0xA4093822299F31D0ULL, 0x082EFA98EC4E6C89ULL}};
+}
+
+static void hash_block(SourceHash *hash, const char *block) {
+  uint64_t word;
+  for (int i = 0; i < 4; i++) {
+    memcpy(&word, block + 8 * i, 8);
+    hash->lanes[i] = (hash->lanes[i] ^ word) * 0xBF58476D1CE4E5B9ULL;
+    hash->lanes[i] ^= hash->lanes[i] >> 31;
+  }
+}
+
+void update_source_hash(SourceHash *hash, const char *bytes, size_t length) {
+  const char *p = bytes, *end = bytes + length;
+  size_t pending = hash->length % SOURCE_HASH_BLOCK;
+  hash->length += length;
+  if (pending > 0) {
+    size_t fill = SOURCE_HASH_BLOCK - pending;
+    if (fill > length)
+      fill = length;
+    memcpy(hash->pending + pending, p, fill);
+    p += fill;
+    if (pending + fill < SOURCE_HASH_BLOCK)
+      return;
+    hash_block(hash, hash->pending);
+  }
+  for (; end - p >= SOURCE_HASH_BLOCK; p += SOURCE_HASH_BLOCK)
+    hash_block(hash, p);
+  memcpy(hash->pending, p, end - p);
+}
+
+uint64_t source_hash_value(const SourceHash *hash) {
+  uint64_t value = hash->length * 0x9E3779B97F4A7C15ULL;
+  for (int i = 0; i < 4; i++) {
+    value = (value ^ hash->lanes[i]) * 0x94D049BB133111EBULL;
+    value ^= value >> 29;
+  }
+  const char *p = hash->pending;
+  const char *end = p + hash->length % SOURCE_HASH_BLOCK;
+  for (; p < end; p += 8) {
+    uint64_t word = 0;
+    memcpy(&word, p, end - p < 8 ? (size_t)(end - p) : 8);
+    value = (value ^ word) * 0xBF58476D1CE4E5B9ULL;
+    value ^= value >> 31;
+  }
+  return value;
+}
+
+uint64_t hash_source(const char *source, size_t length) {
+  SourceHash hash = init_source_hash();
+  update_source_hash(&hash, source, length);
+  return source_hash_value(&hash);
+}
+
+const char *map_file_contents(const char *filename, size_t *length) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
     return NULL;
+
+  struct stat info;
+  if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t file_size = (size_t)info.st_size;
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  char *contents;
+  if (file_size % page_size != 0) {
+    // The rest of the last page is zero filled: the NUL sentinel is free.
+    contents = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  } else {
+    // Page aligned: reserve an extra zero page behind the file for the
+    // sentinel and map the file over the front of the reservation.
+    contents = mmap(NULL, file_size + page_size, PROT_READ,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (contents != MAP_FAILED &&
+        mmap(contents, file_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) ==
+            MAP_FAILED) {
+      munmap(contents, file_size + page_size);
+      contents = MAP_FAILED;
+    }
   }
+  close(fd);
+
+  if (contents == MAP_FAILED)
+    return NULL;
+
+  madvise(contents, file_size, MADV_SEQUENTIAL);
+  *length = file_size;
+  return contents;
+}
+
+void unmap_file_contents(const char *contents, size_t length) {
+  // `length + 1` covers the sentinel page of page aligned files.
+  munmap((void *)contents, length + 1);
+}
+
+char *read_file_contents(const char *filename, size_t *length) {
+  FILE *file = fopen(filename, "r");
+  if (file == NULL)
+    return NULL;
 
   fseek(file, 0, SEEK_END);
   long file_size = ftell(file);
   if (file_size < 0) {
-    fprintf(stderr, ERROR": getting file size: %s\n", filename);
+    fclose(file);
     return NULL;
   }
   rewind(file);
-  if (file_size < 0) {
-    fprintf(stderr, ERROR": getting file size: %s\n", filename);
-    return NULL;
-  }
 
   char *file_contents = malloc(file_size + 1);
   if (file_contents == NULL) {
-    fprintf(stderr, ERROR": memory allocation for file %s failed\n", filename);
     fclose(file);
     return NULL;
   }
 
   size_t bytes_read = fread(file_contents, 1, file_size, file);
   if (bytes_read < (size_t)file_size) {
-    fprintf(stderr, ERROR": reading file contents\n");
     free(file_contents);
     fclose(file);
     return NULL;
@@ -39,6 +142,7 @@ char *read_file_contents(const char *filename) {
 
   file_contents[file_size] = '\0';
   fclose(file);
+  *length = (size_t)file_size;
 
   return file_contents;
 }
@@ -56,7 +160,7 @@ void debug_token_value(const Value *value) {
     fprintf(stderr, "]\n");
     break;
   case TYPE_BOOL:
-    printf(value->as.bool_value ? " [true]" : " [false]");
+    fprintf(stderr, value->as.bool_value ? "[true]\n" : "[false]\n");
     break;
   case TYPE_STRING:
     fprintf(stderr, "String \"");
@@ -77,42 +181,250 @@ void debug_token_value(const Value *value) {
 void debug_token(const Token *token) {
   fprintf(stderr, "Token {\n");
   fprintf(stderr, " type: %s\n", TOKEN_REPRESENTATIONS[token->type].name);
+  if (token->symbol != SYMBOL_NONE)
+    fprintf(stderr, " symbol: %u\n", token->symbol);
   fprintf(stderr,
-          " line: %zu\n"
           " start: %p\n"
           " value: ",
-          token->line, (void *)token->start);
+          (void *)token->start);
   debug_token_value(&token->value);
   fprintf(stderr, "}\n");
 }
 
-void display_token(const Token *token) {
-  printf("%s", TOKEN_REPRESENTATIONS[token->type].name);
+// Output
+
+void output_flush(Output *out) {
+  if (out->ahead != NULL)
+    output_flush(out->ahead);
+  if (out->spill != NULL) {
+    if (out->length > 0)
+      out->spill(out, out->data, out->length);
+    out->length = 0;
+    return;
+  }
+  if (out->sink != NULL && out->length > 0) {
+    fwrite(out->data, 1, out->length, out->sink);
+    out->length = 0;
+  }
+  if (out->sink != NULL)
+    fflush(out->sink);
+}
+
+void output_write(Output *out, const char *bytes, size_t length) {
+  if (length == 0)
+    return;
+  if (out->length + length > out->capacity) {
+    if (out->sink != NULL) {
+      output_flush(out);
+      // Too big to be worth buffering.
+      if (length >= OUTPUT_BLOCK) {
+        if (out->spill != NULL)
+          out->spill(out, bytes, length);
+        else
+          fwrite(bytes, 1, length, out->sink);
+        return;
+      }
+    }
+    size_t capacity = out->capacity ? out->capacity : OUTPUT_BLOCK;
+    while (capacity < out->length + length)
+      capacity *= 2;
+    if (capacity != out->capacity) {
+      char *data = realloc(out->data, capacity);
+      if (data == NULL) {
+        fprintf(stderr, ERROR ": memory allocation for output failed\n");
+        exit(EXIT_FAILURE);
+      }
+      out->data = data;
+      out->capacity = capacity;
+    }
+  }
+  memcpy(out->data + out->length, bytes, length);
+  out->length += length;
+}
+
+void output_string(Output *out, const char *string) {
+  output_write(out, string, strlen(string));
+}
+
+// Same text as `printf("%f", number)`. When the value scaled by 10^6 is far
+// enough from a rounding tie the digits come from integer arithmetic;
+// anything else is left to `snprintf`.
+void output_number(Output *out, double number) {
+  char buf[32];
+  double scaled = number * 1e6;
+  if (!signbit(scaled) && scaled < 8e9) {
+    uint64_t whole = (uint64_t)scaled;
+    double fraction = scaled - (double)whole;
+    if (fraction > 0.5 - 1e-4 && fraction < 0.5 + 1e-4)
+      goto slow;
+    uint64_t digits = whole + (fraction > 0.5);
+    uint64_t integer = digits / 1000000, decimals = digits % 1000000;
+    char *end = buf + sizeof(buf);
+    char *p = end;
+    for (int i = 0; i < 6; i++, decimals /= 10)
+      *--p = (char)('0' + decimals % 10);
+    *--p = '.';
+    do {
+      *--p = (char)('0' + integer % 10);
+      integer /= 10;
+    } while (integer > 0);
+    output_write(out, p, end - p);
+    return;
+  }
+slow:;
+  int length = snprintf(buf, sizeof(buf), "%f", number);
+  if (length < (int)sizeof(buf)) {
+    output_write(out, buf, (size_t)length);
+  } else {
+    char *big = malloc((size_t)length + 1);
+    if (big == NULL) {
+      fprintf(stderr, ERROR ": memory allocation for output failed\n");
+      exit(EXIT_FAILURE);
+    }
+    snprintf(big, (size_t)length + 1, "%f", number);
+    output_write(out, big, (size_t)length);
+    free(big);
+  }
+}
+
+void output_format(Output *out, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  output_vformat(out, fmt, args);
+  va_end(args);
+}
+
+void output_vformat(Output *out, const char *fmt, va_list args) {
+  char buf[256];
+  va_list again;
+  va_copy(again, args);
+  int length = vsnprintf(buf, sizeof(buf), fmt, args);
+  if (length < (int)sizeof(buf)) {
+    output_write(out, buf, length > 0 ? (size_t)length : 0);
+  } else {
+    char *big = malloc((size_t)length + 1);
+    if (big == NULL) {
+      fprintf(stderr, ERROR ": memory allocation for output failed\n");
+      exit(EXIT_FAILURE);
+    }
+    vsnprintf(big, (size_t)length + 1, fmt, again);
+    output_write(out, big, (size_t)length);
+    free(big);
+  }
+  va_end(again);
+}
+
+void report_error(Output *errors, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  Output fallback = {.sink = stderr};
+  if (errors == NULL)
+    errors = &fallback;
+  output_string(errors, ERROR ": ");
+  output_vformat(errors, fmt, args);
+  output_string(errors, "\n");
+  output_flush(errors);
+  free_output(&fallback);
+  va_end(args);
+}
+
+void free_output(Output *out) {
+  output_flush(out);
+  free(out->data);
+  *out = (Output){0};
+}
+
+// Arena
+
+void *arena_alloc(Arena *arena, size_t size, size_t align) {
+  uintptr_t next = ((uintptr_t)arena->next + align - 1) & ~(uintptr_t)(align - 1);
+  uintptr_t end = (uintptr_t)arena->end;
+  if (arena->next != NULL && next <= end && size <= end - next) {
+    arena->next = (char *)next + size;
+    return (void *)next;
+  }
+
+  // malloc's alignment covers everything allocated here.
+  if (size > ARENA_BLOCK / 4) {
+    char *large = malloc(size);
+    if (large == NULL) {
+      fprintf(stderr, ERROR ": memory allocation for arena failed\n");
+      exit(EXIT_FAILURE);
+    }
+    arrput(arena->large, large);
+    return large;
+  }
+
+  char *block = malloc(ARENA_BLOCK);
+  if (block == NULL) {
+    fprintf(stderr, ERROR ": memory allocation for arena failed\n");
+    exit(EXIT_FAILURE);
+  }
+  arrput(arena->blocks, block);
+  arena->next = block + size;
+  arena->end = block + ARENA_BLOCK;
+  return block;
+}
+
+void arena_adopt(Arena *arena, Arena *from) {
+  for (size_t i = 0; i < arrlenu(from->blocks); i++)
+    arrput(arena->blocks, from->blocks[i]);
+  for (size_t i = 0; i < arrlenu(from->large); i++)
+    arrput(arena->large, from->large[i]);
+  arrfree(from->blocks);
+  arrfree(from->large);
+  *from = (Arena){0};
+}
+
+void arena_reset(Arena *arena) {
+  for (size_t i = 0; i < arrlenu(arena->large); i++)
+    free(arena->large[i]);
+  arrfree(arena->large);
+  if (arrlenu(arena->blocks) == 0)
+    return;
+  for (size_t i = 1; i < arrlenu(arena->blocks); i++)
+    free(arena->blocks[i]);
+  arrsetlen(arena->blocks, 1);
+  arena->next = arena->blocks[0];
+  arena->end = arena->blocks[0] + ARENA_BLOCK;
+}
+
+void free_arena(Arena *arena) {
+  for (size_t i = 0; i < arrlenu(arena->blocks); i++)
+    free(arena->blocks[i]);
+  for (size_t i = 0; i < arrlenu(arena->large); i++)
+    free(arena->large[i]);
+  arrfree(arena->blocks);
+  arrfree(arena->large);
+  *arena = (Arena){0};
+}
+
+void display_token(Output *out, const Token *token) {
+  output_string(out, TOKEN_REPRESENTATIONS[token->type].name);
   switch (token->value.type) {
   case TYPE_NULL:
     break;
   case TYPE_IDENTIFIER:
-    printf(" [");
-    for (size_t i = 0; i < token->value.as.identifier_value.length; i++) {
-      printf("%c", token->value.as.identifier_value.start[i]);
-    }
-    printf("]");
+    output_write(out, " [", 2);
+    output_write(out, token->value.as.identifier_value.start,
+                 token->value.as.identifier_value.length);
+    output_write(out, "]", 1);
     break;
   case TYPE_BOOL:
-    printf(token->value.as.bool_value ? " [true]" : " [false]");
+    output_string(out, token->value.as.bool_value ? " [true]" : " [false]");
     break;
   case TYPE_STRING:
-    printf(" \"");
-    for (size_t i = 0; i < token->value.as.string_value.length; i++) {
-      printf("%c", token->value.as.string_value.start[i]);
-    }
-    printf("\"");
+    output_write(out, " \"", 2);
+    output_write(out, token->value.as.string_value.start,
+                 token->value.as.string_value.length);
+    output_write(out, "\"", 1);
     break;
   case TYPE_NUMBER:
-    printf(" %f", token->value.as.number_value);
+    output_write(out, " ", 1);
+    output_number(out, token->value.as.number_value);
     break;
   }
-  printf("\n");
+  output_write(out, "\n", 1);
 }
 
 void debug_lexer(const Lexer *lexer) {
@@ -133,9 +445,11 @@ void debug_lexer(const Lexer *lexer) {
 
   // print token vector
   fprintf(stderr, " tokens: [...]\n");
+  size_t line, column;
+  lexer_position(lexer, lexer->current, &line, &column);
   fprintf(stderr,
           " line: %zu,\n"
-          " line_offset: %zu,\n"
+          " column: %zu,\n"
           "}\n",
-          lexer->line, lexer->line_offset);
+          line, column);
 }
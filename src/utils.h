@@ -1,13 +1,18 @@
 #ifndef UTILS_H
 #define UTILS_H
 #include "lexer.h"
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #define RED_START "\033[31m"
 #define RED_END "\033[0m"
 #define ERROR RED_START "ERROR" RED_END 
 
+#ifndef DEBUG
 #define DEBUG 1
+#endif
 #if DEBUG
 
 #define ASSERT(cond, ...)                                                      \
@@ -65,11 +70,79 @@
 #define defer_with(RESULT) \
     result = (RESULT); goto defer;\
 
-// Read the file contents
-char *read_file_contents(const char *filename);
+// Read the file contents into a NUL terminated heap copy, or return NULL
+// for the caller to report.
+char *read_file_contents(const char *filename, size_t *length);
+// Map a regular, non-empty file read-only. The mapping is followed by a NUL
+// sentinel. Returns NULL when the file can't be mapped.
+const char *map_file_contents(const char *filename, size_t *length);
+void unmap_file_contents(const char *contents, size_t length);
+// Content hash of a source, far cheaper to compute than lexing it.
+uint64_t hash_source(const char *source, size_t length);
+
+// The same hash over a source fed in pieces of any size.
+#define SOURCE_HASH_BLOCK 32
+struct SourceHash {
+  uint64_t lanes[4];
+  uint64_t length; // bytes fed so far
+  char pending[SOURCE_HASH_BLOCK]; // the tail after the last whole block
+};
+
+SourceHash init_source_hash(void);
+void update_source_hash(SourceHash *hash, const char *bytes, size_t length);
+uint64_t source_hash_value(const SourceHash *hash);
+
+// Buffered output: bytes collect in `data` and reach `sink` in large writes.
+// With a NULL sink the buffer just grows. Flush before exiting so output
+// isn't lost.
+struct Output {
+  FILE *sink;
+  char *data;
+  size_t length;
+  size_t capacity;
+  // Flushed first whenever this output is flushed, which keeps two streams
+  // in order, e.g. tokens on stdout ahead of the errors that follow them.
+  Output *ahead;
+  // When set, is handed what would be written to `sink`, which then only
+  // says where it is headed.
+  void (*spill)(Output *out, const char *bytes, size_t length);
+  void *context; // for `spill`
+};
+#define OUTPUT_BLOCK (64 * 1024)
+
+void output_write(Output *out, const char *bytes, size_t length);
+void output_string(Output *out, const char *string);
+void output_number(Output *out, double number);
+void output_format(Output *out, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void output_vformat(Output *out, const char *fmt, va_list args);
+// Writes "ERROR: " and the message as a line to `errors`, or to stderr when
+// it is NULL, and flushes it.
+void report_error(Output *errors, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void output_flush(Output *out);
+void free_output(Output *out);
+
+// Bump allocator: allocations are carved out of ARENA_BLOCK sized blocks that
+// never move, so everything handed out stays put until the arena is reset or
+// freed. Requests too big for a block get an allocation of their own.
+struct Arena {
+  char **blocks; // Vec<char*>, ARENA_BLOCK bytes each
+  char **large;  // Vec<char*>, allocations that didn't fit a block
+  char *next;    // free space in the current block
+  char *end;
+};
+#define ARENA_BLOCK (64 * 1024)
+
+void *arena_alloc(Arena *arena, size_t size, size_t align);
+// Hand all of `from`'s allocations over to `arena`, leaving `from` empty.
+void arena_adopt(Arena *arena, Arena *from);
+// Drop every allocation, keeping the first block for reuse.
+void arena_reset(Arena *arena);
+void free_arena(Arena *arena);
 
 void debug_token_value(const Value *value);
 void debug_token(const Token *token);
-void display_token(const Token *token);
+void display_token(Output *out, const Token *token);
 void debug_lexer(const Lexer *lexer);
 #endif // UTILS_H
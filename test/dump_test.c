@@ -0,0 +1,104 @@
+#include "dump.h"
+#include "lexer.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Loads a dump written by `clox tokenize --format=bin SOURCE` and checks it
+// against a fresh lex of SOURCE, then checks that the dump is refused for
+// OTHER and for SOURCE cut short.
+//
+// Usage: dump_test DUMP SOURCE OTHER
+
+static bool same_value(const Value *a, const Value *b) {
+  if (a->type != b->type)
+    return false;
+  switch (a->type) {
+  case TYPE_IDENTIFIER:
+    return a->as.identifier_value.length == b->as.identifier_value.length &&
+           a->as.identifier_value.start == b->as.identifier_value.start;
+  case TYPE_STRING:
+    return a->as.string_value.length == b->as.string_value.length &&
+           (a->as.string_value.length == 0 ||
+            memcmp(a->as.string_value.start, b->as.string_value.start,
+                   a->as.string_value.length) == 0);
+  case TYPE_NUMBER:
+    return a->as.number_value == b->as.number_value;
+  case TYPE_BOOL:
+    return a->as.bool_value == b->as.bool_value;
+  default:
+    return true;
+  }
+}
+
+static char *read_source(const char *filename, size_t *length) {
+  char *source = read_file_contents(filename, length);
+  if (source == NULL) {
+    fprintf(stderr, ERROR ": couldn't read %s\n", filename);
+    exit(1);
+  }
+  return source;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 4) {
+    fprintf(stderr, "Usage: dump_test DUMP SOURCE OTHER\n");
+    return 2;
+  }
+  const char *dump_filename = argv[1];
+  size_t source_len = 0, other_len = 0;
+  char *source = read_source(argv[2], &source_len);
+  char *other = read_source(argv[3], &other_len);
+
+  TokenDump dump;
+  if (!load_token_dump(dump_filename, source, source_len, &dump))
+    return 1;
+
+  int failures = 0;
+  Lexer lexer = init_lexer(argv[2], source, source_len); // owns `source`
+  lexer.silent = true;
+  size_t index = 0;
+  for (;;) {
+    Token token = next_token(&lexer);
+    if (token.type == TOKEN_COMMENT || token.type == TOKEN_ERROR)
+      continue;
+    Token loaded = dump_token(&dump, index);
+    if (token.type != loaded.type || token.start != loaded.start ||
+        !same_value(&token.value, &loaded.value)) {
+      fprintf(stderr, "token %zu differs from the dump:\n", index);
+      debug_token(&token);
+      debug_token(&loaded);
+      failures++;
+      break;
+    }
+    index++;
+    if (token.type == TOKEN_EOF)
+      break;
+  }
+  if (index != dump.count) {
+    fprintf(stderr, "lexed %zu tokens, the dump has %zu\n", index,
+            dump.count);
+    failures++;
+  }
+  free_token_dump(&dump);
+
+  // Both are reported on stderr, as a mismatch would be in use.
+  if (load_token_dump(dump_filename, other, other_len, &dump)) {
+    fprintf(stderr, "the dump loaded against %s\n", argv[3]);
+    free_token_dump(&dump);
+    failures++;
+  }
+  if (load_token_dump(dump_filename, source, source_len - 1, &dump)) {
+    fprintf(stderr, "the dump loaded against a truncated %s\n", argv[2]);
+    free_token_dump(&dump);
+    failures++;
+  }
+
+  free_lexer(&lexer);
+  free(other);
+  if (failures > 0)
+    return 1;
+  printf("dump_test: %zu tokens match %s\n", index, argv[2]);
+  return 0;
+}
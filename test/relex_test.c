@@ -0,0 +1,179 @@
+#include "lexer.h"
+#include "utils.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Applies random edits to an `EditBuffer` and after each one compares its
+// text, tokens and positions with a fresh `scan_tokens` of the edited text.
+//
+// Usage: relex_test [SEED [EDITS]]
+
+static const char *PIECES[] = {
+    "foo",   "bar",     "x1",     "_tmp",   "\xce\xb1\xce\xb2", "and",
+    "class", "nil",     "true",   "false",  "while",   "12",
+    "3.25",  "7.",      "\"s\"",  "\"a\\nb\"", "\"\"",  "\"open",
+    "\\",    "\"",      "// c\n", "//",     "/",       "(",
+    ")",     "{",       "}",      ",",      ".",       ";",
+    "-",     "+",       "*",      "!",      "!=",      "=",
+    "==",    "<",       "<=",     ">",      ">=",      " ",
+    "  ",    "\n",      "\t",     "\r\n",   "@",       "\xff",
+    // Long enough for the vector UTF-8 check, some malformed.
+    "\"\xe2\x82\xac and \xf0\x9f\x98\x80 in a long string\"",
+    "caf\xc3\xa9_\xe2\x82\xac_long_identifier",
+    "\"a surrogate \xed\xa0\x80 in a long string\"",
+    "overlong_\xe0\x80\x80_identifier", "\xf4\x90\x80\x80",
+};
+#define PIECE_COUNT (sizeof(PIECES) / sizeof(PIECES[0]))
+
+static uint64_t state;
+
+static uint64_t next_random(void) {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+}
+
+static void random_text(Output *out, size_t pieces) {
+  for (size_t i = 0; i < pieces; i++) {
+    output_string(out, PIECES[next_random() % PIECE_COUNT]);
+    if (next_random() % 3 == 0)
+      output_string(out, next_random() % 4 == 0 ? "\n" : " ");
+  }
+}
+
+// A NUL terminated heap copy, for `init_lexer`.
+static char *copy_text(const Output *text) {
+  char *copy = malloc(text->length + 1);
+  if (text->length > 0)
+    memcpy(copy, text->data, text->length);
+  copy[text->length] = '\0';
+  return copy;
+}
+
+static void append(Output *out, const char *bytes, size_t length) {
+  if (length > 0)
+    output_write(out, bytes, length);
+}
+
+static bool same_string(String a, String b) {
+  return a.length == b.length &&
+         (a.length == 0 || memcmp(a.start, b.start, a.length) == 0);
+}
+
+// Reports the first difference, if any.
+static bool same_tokens(const EditBuffer *buffer, const Lexer *lexer) {
+  size_t count = arrlenu(lexer->tokens);
+  if (buffer->token_count != count) {
+    fprintf(stderr, "%zu tokens, %zu expected\n", buffer->token_count, count);
+    return false;
+  }
+  if (buffer->line_count != arrlenu(lexer->line_starts)) {
+    fprintf(stderr, "%zu lines, %zu expected\n", buffer->line_count,
+            arrlenu(lexer->line_starts));
+    return false;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    Token token = edit_token(buffer, i);
+    const Token *expected = &lexer->tokens[i];
+    size_t line, column, expected_line, expected_column;
+    edit_position(buffer, token.start, &line, &column);
+    lexer_position(lexer, expected->start, &expected_line, &expected_column);
+
+    bool same = token.type == expected->type &&
+                edit_offset(buffer, token.start) ==
+                    (size_t)(expected->start - lexer->source) &&
+                line == expected_line && column == expected_column &&
+                token.value.type == expected->value.type;
+    if (same && token.type == TOKEN_IDENTIFIER)
+      same = same_string(token.value.as.identifier_value,
+                         expected->value.as.identifier_value) &&
+             same_string(symbol_name(buffer->symbols, token.symbol),
+                         expected->value.as.identifier_value);
+    else if (same && token.type == TOKEN_STRING)
+      same = same_string(token.value.as.string_value,
+                         expected->value.as.string_value);
+    else if (same && token.type == TOKEN_NUMBER)
+      same = token.value.as.number_value == expected->value.as.number_value;
+    if (!same) {
+      fprintf(stderr, "token %zu differs:\n", i);
+      debug_token(&token);
+      debug_token(expected);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  state = argc > 1 ? strtoull(argv[1], NULL, 10) : 1;
+  size_t edits = argc > 2 ? strtoull(argv[2], NULL, 10) : 2000;
+  if (state == 0)
+    state = 1;
+
+  Output text = {0};
+  random_text(&text, 400);
+  Lexer lexer = init_lexer("relex_test", copy_text(&text), text.length);
+  lexer.silent = true;
+  scan_tokens(&lexer);
+  EditBuffer buffer = init_edit_buffer(&lexer);
+  free_lexer(&lexer);
+
+  size_t start = 0;
+  for (size_t i = 0; i < edits; i++) {
+    // Mostly edits near the previous one, as when typing.
+    if (next_random() % 4 == 0)
+      start = next_random() % (text.length + 1);
+    else {
+      size_t step = next_random() % 33;
+      start = start + step > 16 ? start + step - 16 : 0;
+    }
+    if (start > text.length)
+      start = text.length;
+    size_t end = start + next_random() % 12;
+    if (end > text.length)
+      end = text.length;
+    Output replacement = {0};
+    random_text(&replacement, next_random() % 4);
+
+    size_t inserted = replacement.length;
+    relex_edit(&buffer, start, end, replacement.data, inserted);
+
+    Output edited = {0};
+    append(&edited, text.data, start);
+    append(&edited, replacement.data, replacement.length);
+    append(&edited, text.data + end, text.length - end);
+    free_output(&replacement);
+    free_output(&text);
+    text = edited;
+
+    String front = {.start = buffer.text, .length = buffer.gap};
+    String back = {.start = buffer.text + buffer.gap + buffer.gap_len,
+                   .length = buffer.length - buffer.gap};
+    if (buffer.length != text.length ||
+        !same_string(front, (String){text.data, buffer.gap}) ||
+        !same_string(back, (String){text.data + buffer.gap, back.length})) {
+      fprintf(stderr, "edit %zu: the text differs\n", i);
+      return 1;
+    }
+
+    Lexer fresh = init_lexer("relex_test", copy_text(&text), text.length);
+    fresh.silent = true;
+    scan_tokens(&fresh);
+    bool same = same_tokens(&buffer, &fresh);
+    free_lexer(&fresh);
+    if (!same) {
+      fprintf(stderr, "edit %zu: [%zu, %zu) with %zu bytes\n", i, start, end,
+              inserted);
+      return 1;
+    }
+  }
+
+  free_edit_buffer(&buffer);
+  free_output(&text);
+  printf("relex_test: %zu edits match a fresh scan\n", edits);
+  return 0;
+}